@@ -4,6 +4,8 @@
 #include <fcntl.h>      // Управление файлами (open, O_RDONLY, O_WRONLY)
 #include <string.h>     // Работа со строками (strlen, strcpy)
 #include <time.h>       // Работа со временем (не используется здесь, но может понадобиться)
+#include <stdint.h>     // Целые фиксированного размера (uint64_t) для структуры драйвера
+#include <sys/ioctl.h>  // ioctl для канала запрос-ответ
 
 // Размер буфера для операций чтения/записи
 #define BUFFER_SIZE 256
@@ -12,13 +14,72 @@
 // Путь к устройству для чтения (второй драйвер)
 #define DEV_READ  "/dev/scull_buffer1"
 
-int main() {
+// Канал запрос-ответ драйвера (ioctl SCULL_IOC_RPC_*): один системный
+// вызов на обмен вместо write() и read() через два кольца.
+// Команды и структура должны совпадать с драйвером (scull_buffer.c)
+#define SCULL_IOC_RPC_CALL  13
+#define SCULL_IOC_RPC_SERVE 14
+// Устройство, через которое процессы A и B обмениваются в режиме rpc
+#define DEV_RPC "/dev/scull_buffer0"
+
+struct scull_rpc {
+    uint64_t id;
+    uint64_t req;
+    uint64_t reply;
+    uint32_t req_len;
+    uint32_t reply_len;
+};
+
+// Режим rpc: процесс A - клиент. Отправляет запрос и в том же вызове
+// ioctl получает ответ процесса B
+static int rpc_client(void) {
+    char message[BUFFER_SIZE];      // Запрос
+    char reply[BUFFER_SIZE];        // Ответ
+    struct scull_rpc rpc;           // Описание обмена для драйвера
+    int counter = 0;                // Счетчик сообщений
+
+    int fd = open(DEV_RPC, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open rpc device");
+        exit(EXIT_FAILURE);
+    }
+    printf("Process A started in rpc mode (PID: %d). Calling %s\n", getpid(), DEV_RPC);
+
+    while (1) {
+        snprintf(message, BUFFER_SIZE, "Request from Process A #%d", counter++);
+
+        memset(&rpc, 0, sizeof(rpc));
+        rpc.req = (uintptr_t)message;
+        rpc.req_len = strlen(message);
+        rpc.reply = (uintptr_t)reply;
+        rpc.reply_len = BUFFER_SIZE - 1; // -1 для места под '\0'
+        if (ioctl(fd, SCULL_IOC_RPC_CALL, &rpc) < 0) {
+            perror("RPC call failed");
+        } else {
+            reply[rpc.reply_len] = '\0';
+            printf("Process A: Sent '%s', got reply '%s'\n", message, reply);
+        }
+
+        sleep(1); // Задержка 1 секунда для наглядности работы
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // ./process_a rpc - обмен через канал запрос-ответ, а не через два кольца
+    if (argc > 1 && strcmp(argv[1], "rpc") == 0)
+        return rpc_client();
+
     int fd_write, fd_read;          // Файловые дескрипторы устройств
     char message[BUFFER_SIZE];      // Буфер для формируемых сообщений
     char read_buf[BUFFER_SIZE];     // Буфер для чтения данных
     int counter = 0;                // Счетчик сообщений
     ssize_t ret;                    // Для хранения возвращаемых значений read/write
 
+    // Каждым дескриптором пользуется один поток: в режиме SPSC драйвер
+    // отвечает -EBUSY на одновременные вызовы через один и тот же файл
     // Открываем устройство для записи в блокирующем режиме
     fd_write = open(DEV_WRITE, O_WRONLY);
     if (fd_write < 0) {
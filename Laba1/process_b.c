@@ -4,6 +4,8 @@
 #include <fcntl.h>      // Управление файлами
 #include <string.h>     // Работа со строками
 #include <time.h>       // Работа со временем
+#include <stdint.h>     // Целые фиксированного размера (uint64_t) для структуры драйвера
+#include <sys/ioctl.h>  // ioctl для канала запрос-ответ
 
 // Размер буфера для операций чтения/записи
 #define BUFFER_SIZE 256
@@ -12,13 +14,73 @@
 // Путь к устройству для записи (второй драйвер)
 #define DEV_WRITE "/dev/scull_buffer1"
 
-int main() {
+// Канал запрос-ответ драйвера (ioctl SCULL_IOC_RPC_*): один системный
+// вызов на обмен вместо write() и read() через два кольца.
+// Команды и структура должны совпадать с драйвером (scull_buffer.c)
+#define SCULL_IOC_RPC_CALL  13
+#define SCULL_IOC_RPC_SERVE 14
+// Устройство, через которое процессы A и B обмениваются в режиме rpc
+#define DEV_RPC "/dev/scull_buffer0"
+
+struct scull_rpc {
+    uint64_t id;
+    uint64_t req;
+    uint64_t reply;
+    uint32_t req_len;
+    uint32_t reply_len;
+};
+
+// Режим rpc: процесс B - сервер. Одним вызовом ioctl отвечает на
+// прошлый запрос и ждет следующий
+static int rpc_server(void) {
+    char request[BUFFER_SIZE];      // Запрос
+    char reply[BUFFER_SIZE];        // Ответ на него
+    struct scull_rpc rpc;           // Описание обмена для драйвера
+    int counter = 0;                // Счетчик сообщений
+
+    int fd = open(DEV_RPC, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open rpc device");
+        exit(EXIT_FAILURE);
+    }
+    printf("Process B started in rpc mode (PID: %d). Serving %s\n", getpid(), DEV_RPC);
+
+    memset(&rpc, 0, sizeof(rpc)); // id = 0: отвечать пока не на что
+    while (1) {
+        rpc.req = (uintptr_t)request;
+        rpc.req_len = BUFFER_SIZE - 1; // -1 для места под '\0'
+        if (ioctl(fd, SCULL_IOC_RPC_SERVE, &rpc) < 0) {
+            perror("RPC serve failed");
+            rpc.id = 0; // Ответ (если был) уже отправлен, просто ждем новый запрос
+            sleep(1);
+            continue;
+        }
+        request[rpc.req_len] = '\0';
+        printf("Process B: Got request '%s'\n", request);
+
+        // Ответ уйдет следующим вызовом вместе с ожиданием нового запроса
+        snprintf(reply, BUFFER_SIZE, "Reply from Process B #%d", counter++);
+        rpc.reply = (uintptr_t)reply;
+        rpc.reply_len = strlen(reply);
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // ./process_b rpc - обмен через канал запрос-ответ, а не через два кольца
+    if (argc > 1 && strcmp(argv[1], "rpc") == 0)
+        return rpc_server();
+
     int fd_read, fd_write;         // Файловые дескрипторы устройств
     char message[BUFFER_SIZE];     // Буфер для формируемых сообщений
     char read_buf[BUFFER_SIZE];    // Буфер для чтения данных
     int counter = 0;               // Счетчик сообщений
     ssize_t ret;                   // Для хранения возвращаемых значений read/write
 
+    // Каждым дескриптором пользуется один поток: в режиме SPSC драйвер
+    // отвечает -EBUSY на одновременные вызовы через один и тот же файл
     // Открываем устройство для чтения в блокирующем режиме
     fd_read = open(DEV_READ, O_RDONLY);
     if (fd_read < 0) {
@@ -1,33 +1,119 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
-int main() {
-    int fd1 = open("/dev/scull_buffer0", O_RDONLY | O_NONBLOCK);
-    int fd2 = open("/dev/scull_buffer1", O_RDONLY | O_NONBLOCK);
+// Монитор устройств scull_buffer в стиле top. Раз в интервал один вызов
+// ioctl(SCULL_IOC_SNAPSHOT) возвращает состояние всех устройств сразу -
+// без мьютексов драйвера, поэтому монитор не мешает чтению и записи.
+// Запуск: ./process_c [интервал в секундах, по умолчанию 2]
 
-    if (fd1 < 0 || fd2 < 0) {
+// Команда и структуры должны совпадать с драйвером (scull_buffer.c)
+#define SCULL_IOC_SNAPSHOT 11
+#define MAX_DEVICES 256
+
+struct scull_dev_snap {
+    uint32_t minor;
+    uint32_t mode;
+    uint32_t capacity;
+    uint32_t data_size;
+    uint32_t high_water;
+    uint32_t read_waiters;
+    uint32_t write_waiters;
+    uint32_t pad;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t read_blocks;
+    uint64_t write_blocks;
+    uint64_t lost_bytes;
+};
+
+struct scull_snap_req {
+    uint64_t entries;
+    uint32_t max;
+    uint32_t nr;
+};
+
+// Текущий и предыдущий снимки: скорости считаются по разнице
+static struct scull_dev_snap cur[MAX_DEVICES], prev[MAX_DEVICES];
+
+// Время в секундах (монотонные часы)
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int interval = argc > 1 ? atoi(argv[1]) : 2;
+    struct scull_snap_req req;
+    unsigned int i, n, nprev = 0;
+    double t, tprev = 0, dt;
+
+    if (interval <= 0)
+        interval = 2;
+
+    // Снимок отдает управляющее устройство: оно есть, даже если
+    // кольца создаются и удаляются на ходу
+    int fd = open("/dev/scull_control", O_RDONLY);
+    if (fd < 0) {
         perror("open");
         exit(1);
     }
 
-    int size1, size2;
-
     while (1) {
-        // Используем ioctl для получения размера данных
-        if (ioctl(fd1, 0, &size1) == 0) {
-            printf("scull1 buffer data size: %d bytes\n", size1);
+        req.entries = (uintptr_t)cur;
+        req.max = MAX_DEVICES;
+        req.nr = 0;
+        if (ioctl(fd, SCULL_IOC_SNAPSHOT, &req) < 0) {
+            perror("ioctl");
+            exit(1);
         }
-        if (ioctl(fd2, 0, &size2) == 0) {
-            printf("scull2 buffer data size: %d bytes\n", size2);
+        t = now();
+        n = req.nr < MAX_DEVICES ? req.nr : MAX_DEVICES;
+        dt = tprev ? t - tprev : 0;
+
+        // Очищаем экран и выводим таблицу
+        printf("\033[H\033[2J");
+        printf("scull_buffer: %u devices, interval %d s\n\n", req.nr, interval);
+        printf("%4s %6s %10s %10s %5s %10s %10s %9s %9s %4s %4s %10s\n",
+               "DEV", "MODE", "DATA", "CAPACITY", "FILL%", "IN KB/s", "OUT KB/s",
+               "WR/s", "RD/s", "RW", "WW", "LOST");
+
+        for (i = 0; i < n; i++) {
+            struct scull_dev_snap *s = &cur[i];
+            double in = 0, out = 0, wr = 0, rd = 0;
+
+            // Скорости - только если устройство было и в прошлом снимке
+            if (dt > 0 && i < nprev && prev[i].minor == s->minor) {
+                in = (s->bytes_in - prev[i].bytes_in) / 1024.0 / dt;
+                out = (s->bytes_out - prev[i].bytes_out) / 1024.0 / dt;
+                wr = (s->writes - prev[i].writes) / dt;
+                rd = (s->reads - prev[i].reads) / dt;
+            }
+
+            printf("%4u %#6x %10u %10u %5.1f %10.1f %10.1f %9.0f %9.0f %4u %4u %10llu\n",
+                   s->minor, s->mode, s->data_size, s->capacity,
+                   s->capacity ? 100.0 * s->data_size / s->capacity : 0.0,
+                   in, out, wr, rd, s->read_waiters, s->write_waiters,
+                   (unsigned long long)s->lost_bytes);
         }
-        printf("---\n");
-        sleep(2);
+        printf("\nRW/WW - readers/writers sleeping now, LOST - bytes overwritten (OVERWRITE)\n");
+        fflush(stdout);
+
+        memcpy(prev, cur, n * sizeof(cur[0]));
+        nprev = n;
+        tprev = t;
+        sleep(interval);
     }
 
-    close(fd1);
-    close(fd2);
+    close(fd);
     return 0;
 }
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+// Нагрузочный тест scull_buffer: N писателей и M читателей (потоки,
+// у каждого свой открытый файл) гоняют через кольцо сообщения заданного
+// размера. В начале каждого сообщения писатель кладет время отправки,
+// читатель по нему считает задержку доставки.
+// Итог: MB/s, сообщений/с и задержка p50/p99/p999; с -j - одна строка JSON
+// для сравнения версий драйвера.
+// Сборка: gcc -O2 -Wall -pthread -o scull_bench scull_bench.c
+// Запуск: ./scull_bench -w 4 -r 2 -s 256 -n 100000 -m poll
+
+// Команды ioctl и режимы должны совпадать с драйвером (scull_buffer.c)
+#define SCULL_IOC_SET_CAPACITY 5
+#define SCULL_IOC_GET_MODE     8
+#define SCULL_IOC_SET_MODE     9
+#define SCULL_MODE_FRAMED   0x2
+#define SCULL_MODE_BATCH    0x4
+#define SCULL_MODE_MQ       0x8
+#define SCULL_MODE_OVERWRITE 0x80
+// Биты, которые меняет SCULL_IOC_SET_MODE
+#define SCULL_MODE_SETTABLE (SCULL_MODE_FRAMED | SCULL_MODE_BATCH | SCULL_MODE_OVERWRITE)
+
+// Как ждать кольцо
+enum { MODE_BLOCK, MODE_NONBLOCK, MODE_POLL };
+static const char *mode_names[] = { "block", "nonblock", "poll" };
+
+// Заголовок каждого сообщения, дальше - заполнитель до размера сообщения
+struct bench_hdr {
+    uint64_t ts_ns;             // Когда писатель отправил сообщение
+    uint64_t seq;               // Номер сообщения у писателя, STOP - конец теста
+};
+#define STOP UINT64_MAX
+
+// Параметры запуска
+static const char *dev_path = "/dev/scull_buffer0";
+static int writers = 1, readers = 1;
+static size_t msg_size = 64;
+static long msgs = 100000;      // Сообщений на каждого писателя
+static unsigned long capacity;  // 0 - не менять емкость
+static int io_mode = MODE_BLOCK;
+static int byte_stream;         // Потоковый режим вместо записей (только 1:1)
+static int json;
+
+// Общее состояние потоков
+static pthread_barrier_t start_barrier;
+
+struct reader_res {
+    uint64_t *lat;              // Задержки доставки (нс)
+    long nr;                    // Сколько сообщений получено
+    long again;                 // Сколько раз кольцо было пусто (EAGAIN)
+};
+
+struct writer_res {
+    long again;                 // Сколько раз кольцо было полно (EAGAIN)
+};
+
+// Время в наносекундах (монотонные часы, одни и те же для всех потоков)
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Ждем, пока кольцо станет готово: в режиме poll - в poll(),
+// в режиме nonblock - крутимся. Считаем каждую такую паузу
+static void wait_ready(int fd, short events, long *again) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+
+    (*again)++;
+    if (io_mode == MODE_POLL)
+        poll(&pfd, 1, -1);
+}
+
+// Записать сообщение целиком. В режиме записей write() кладет его
+// за один вызов, в потоковом может положить часть
+static int send_msg(int fd, const char *buf, long *again) {
+    size_t done = 0;
+
+    while (done < msg_size) {
+        ssize_t n = write(fd, buf + done, msg_size - done);
+
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                wait_ready(fd, POLLOUT, again);
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Прочитать сообщение целиком (в потоковом режиме - собрать из частей)
+static int recv_msg(int fd, char *buf, long *again) {
+    size_t done = 0;
+
+    while (done < msg_size) {
+        ssize_t n = read(fd, buf + done, msg_size - done);
+
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                wait_ready(fd, POLLIN, again);
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!byte_stream && (size_t)n != msg_size) {
+            fprintf(stderr, "short record: %zd of %zu bytes\n", n, msg_size);
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int open_dev(int flags) {
+    if (io_mode != MODE_BLOCK)
+        flags |= O_NONBLOCK;
+    return open(dev_path, flags);
+}
+
+static void *writer_thread(void *arg) {
+    struct writer_res *res = arg;
+    struct bench_hdr *hdr;
+    char *buf = calloc(1, msg_size);
+    int fd = open_dev(O_WRONLY);
+    long i;
+
+    if (!buf || fd < 0) {
+        perror("writer");
+        exit(1);
+    }
+    hdr = (struct bench_hdr *)buf;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < msgs; i++) {
+        hdr->seq = i;
+        hdr->ts_ns = now_ns();
+        if (send_msg(fd, buf, &res->again) < 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    struct reader_res *res = arg;
+    struct bench_hdr *hdr;
+    char *buf = malloc(msg_size);
+    int fd = open_dev(O_RDONLY);
+    long max = (long)writers * msgs;
+
+    res->lat = malloc(max * sizeof(res->lat[0]));
+    if (!buf || !res->lat || fd < 0) {
+        perror("reader");
+        exit(1);
+    }
+    hdr = (struct bench_hdr *)buf;
+
+    pthread_barrier_wait(&start_barrier);
+    // Читаем до своего сообщения STOP: их по одному на читателя
+    // отправляет main, когда все писатели закончили
+    while (1) {
+        if (recv_msg(fd, buf, &res->again) < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (hdr->seq == STOP)
+            break;
+        if (res->nr < max)
+            res->lat[res->nr] = now_ns() - hdr->ts_ns;
+        res->nr++;
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *v, long n, double p) {
+    return n ? v[(long)(p * (n - 1))] : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d device] [-w writers] [-r readers] [-s msg_size]\n"
+            "          [-n msgs_per_writer] [-c ring_capacity] [-m block|nonblock|poll]\n"
+            "          [-b] [-j]\n"
+            "  -b  byte stream instead of records (one writer and one reader only)\n"
+            "  -j  one line of JSON instead of the table\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t *wt, *rt;
+    struct writer_res *wres;
+    struct reader_res *rres;
+    unsigned int old_mode, new_mode;
+    long total = 0, w_again = 0, r_again = 0, i;
+    uint64_t *lat, t0, t1;
+    double sec, mbps, ops;
+    int opt, ctl;
+
+    while ((opt = getopt(argc, argv, "d:w:r:s:n:c:m:bj")) != -1) {
+        switch (opt) {
+        case 'd': dev_path = optarg; break;
+        case 'w': writers = atoi(optarg); break;
+        case 'r': readers = atoi(optarg); break;
+        case 's': msg_size = strtoul(optarg, NULL, 0); break;
+        case 'n': msgs = atol(optarg); break;
+        case 'c': capacity = strtoul(optarg, NULL, 0); break;
+        case 'm':
+            for (io_mode = 0; io_mode < 3; io_mode++)
+                if (!strcmp(optarg, mode_names[io_mode]))
+                    break;
+            if (io_mode == 3)
+                usage(argv[0]);
+            break;
+        case 'b': byte_stream = 1; break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (writers < 1 || readers < 1 || msgs < 1 || msg_size < sizeof(struct bench_hdr))
+        usage(argv[0]);
+    // В потоке байт сообщения нескольких писателей или читателей
+    // перемешаются, и заголовки будет не найти
+    if (byte_stream && (writers > 1 || readers > 1)) {
+        fprintf(stderr, "-b needs exactly one writer and one reader\n");
+        return 2;
+    }
+
+    // Настройка кольца: емкость и режим записей. Старый режим вернем в конце
+    ctl = open(dev_path, O_RDONLY | O_NONBLOCK);
+    if (ctl < 0) {
+        perror("open");
+        return 1;
+    }
+    if (capacity && ioctl(ctl, SCULL_IOC_SET_CAPACITY, capacity) < 0) {
+        perror("ioctl SET_CAPACITY");
+        return 1;
+    }
+    if (ioctl(ctl, SCULL_IOC_GET_MODE, &old_mode) < 0) {
+        perror("ioctl GET_MODE");
+        return 1;
+    }
+    // Режим MQ хранит записи всегда. Затирание (OVERWRITE) выключаем:
+    // потерянное сообщение STOP повесило бы читателя
+    new_mode = byte_stream || (old_mode & SCULL_MODE_MQ) ? 0 : SCULL_MODE_FRAMED;
+    old_mode &= SCULL_MODE_SETTABLE;
+    if (new_mode != old_mode && ioctl(ctl, SCULL_IOC_SET_MODE, new_mode) < 0) {
+        perror("ioctl SET_MODE");
+        return 1;
+    }
+    // Выбрасываем то, что осталось в кольце от прошлых запусков
+    {
+        char *junk = malloc(1 << 16);
+
+        while (junk && read(ctl, junk, 1 << 16) > 0)
+            ;
+        free(junk);
+    }
+    close(ctl);
+
+    wt = calloc(writers, sizeof(*wt));
+    rt = calloc(readers, sizeof(*rt));
+    wres = calloc(writers, sizeof(*wres));
+    rres = calloc(readers, sizeof(*rres));
+    if (!wt || !rt || !wres || !rres) {
+        perror("calloc");
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, writers + readers + 1);
+    for (i = 0; i < readers; i++)
+        pthread_create(&rt[i], NULL, reader_thread, &rres[i]);
+    for (i = 0; i < writers; i++)
+        pthread_create(&wt[i], NULL, writer_thread, &wres[i]);
+
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    for (i = 0; i < writers; i++) {
+        pthread_join(wt[i], NULL);
+        w_again += wres[i].again;
+    }
+
+    // Все данные отправлены: по сообщению STOP каждому читателю
+    {
+        struct writer_res stop_res = { 0 };
+        char *buf = calloc(1, msg_size);
+        int fd = open_dev(O_WRONLY);
+
+        if (!buf || fd < 0) {
+            perror("stop");
+            return 1;
+        }
+        ((struct bench_hdr *)buf)->seq = STOP;
+        for (i = 0; i < readers; i++) {
+            if (send_msg(fd, buf, &stop_res.again) < 0) {
+                perror("write");
+                return 1;
+            }
+        }
+        close(fd);
+        free(buf);
+    }
+
+    for (i = 0; i < readers; i++) {
+        pthread_join(rt[i], NULL);
+        r_again += rres[i].again;
+        total += rres[i].nr;
+    }
+    t1 = now_ns();
+
+    // Сливаем задержки всех читателей
+    lat = malloc((total ? total : 1) * sizeof(*lat));
+    if (!lat) {
+        perror("malloc");
+        return 1;
+    }
+    total = 0;
+    for (i = 0; i < readers; i++) {
+        long n = rres[i].nr < (long)writers * msgs ? rres[i].nr : (long)writers * msgs;
+
+        memcpy(lat + total, rres[i].lat, n * sizeof(*lat));
+        total += n;
+        free(rres[i].lat);
+    }
+    qsort(lat, total, sizeof(*lat), cmp_u64);
+
+    sec = (t1 - t0) / 1e9;
+    ops = total / sec;
+    mbps = total * (double)msg_size / sec / 1e6;
+
+    if (json) {
+        printf("{\"device\":\"%s\",\"mode\":\"%s\",\"framing\":\"%s\","
+               "\"writers\":%d,\"readers\":%d,\"msg_size\":%zu,\"capacity\":%lu,"
+               "\"messages\":%ld,\"seconds\":%.6f,\"mb_per_s\":%.3f,\"ops_per_s\":%.1f,"
+               "\"lat_p50_ns\":%llu,\"lat_p99_ns\":%llu,\"lat_p999_ns\":%llu,"
+               "\"lat_max_ns\":%llu,\"write_again\":%ld,\"read_again\":%ld}\n",
+               dev_path, mode_names[io_mode], byte_stream ? "stream" : "records",
+               writers, readers, msg_size, capacity, total, sec, mbps, ops,
+               (unsigned long long)percentile(lat, total, 0.50),
+               (unsigned long long)percentile(lat, total, 0.99),
+               (unsigned long long)percentile(lat, total, 0.999),
+               (unsigned long long)(total ? lat[total - 1] : 0), w_again, r_again);
+    } else {
+        printf("%s: %d writers, %d readers, %zu-byte %s, %s I/O\n",
+               dev_path, writers, readers, msg_size,
+               byte_stream ? "stream chunks" : "records", mode_names[io_mode]);
+        printf("  messages   %ld in %.3f s\n", total, sec);
+        printf("  throughput %.1f MB/s, %.0f msg/s\n", mbps, ops);
+        printf("  latency    p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+               percentile(lat, total, 0.50) / 1e3, percentile(lat, total, 0.99) / 1e3,
+               percentile(lat, total, 0.999) / 1e3, (total ? lat[total - 1] : 0) / 1e3);
+        if (io_mode != MODE_BLOCK)
+            printf("  EAGAIN     %ld on write, %ld on read\n", w_again, r_again);
+    }
+
+    // Возвращаем кольцу прежний режим
+    ctl = open(dev_path, O_RDONLY | O_NONBLOCK);
+    if (ctl >= 0) {
+        if (new_mode != old_mode)
+            ioctl(ctl, SCULL_IOC_SET_MODE, old_mode);
+        close(ctl);
+    }
+
+    free(lat);
+    free(wt);
+    free(rt);
+    free(wres);
+    free(rres);
+    pthread_barrier_destroy(&start_barrier);
+    return 0;
+}
@@ -7,56 +7,1014 @@
 #include <linux/uaccess.h>   // Функции копирования между ядром и пользователем
 #include <linux/wait.h>      // Очереди ожидания для синхронизации
 #include <linux/sched.h>     // Определения структур процессов
+#include <linux/sched/clock.h>  // local_clock для бюджета busy-poll
+#include <linux/sched/signal.h> // signal_pending
 #include <linux/mutex.h>     // Мьютексы для взаимного исключения
 #include <linux/device/class.h> //for class_create/class_destroy
 #include <linux/device.h> // for device_create/device_destroy
+#include <linux/miscdevice.h> // Управляющее устройство /dev/scull_control
+#include <linux/mm.h>        // Отображение памяти (vm_area_struct, vm_fault)
+#include <linux/vmalloc.h>   // vzalloc/vfree и vmalloc_to_page для mmap
+#include <linux/topology.h>  // numa_node_id, cpu_to_node для размещения колец
+#include <linux/log2.h>      // roundup_pow_of_two для емкости кольца
+#include <linux/poll.h>      // poll/epoll (poll_wait, EPOLLIN, EPOLLOUT)
+#include <linux/uio.h>       // iov_iter для векторного ввода-вывода (readv/writev, io_uring)
+#include <linux/percpu.h>    // Счетчики статистики на каждом CPU
+#include <linux/debugfs.h>   // Статистика устройств в /sys/kernel/debug/scull_buffer
+#include <linux/seq_file.h>  // Вывод файлов debugfs
+#include <linux/ktime.h>     // ktime_get_ns для гистограмм времени ожидания
+#include <linux/eventfd.h>   // Уведомления через eventfd (SCULL_IOC_EVENTFD)
 
 #include <linux/version.h> // for kenel version
 
+// Точки трассировки (enqueue, dequeue, sleep, wakeup) вместо pr_info на каждой операции
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 // Имя устройства для регистрации в системе
 #define DEVICE_NAME "scull_buffer"
-// Размер кольцевого буфера в байтах
-#define BUFFER_SIZE 1024
-// Количество создаваемых устройств (два драйвера)
+// Размер кольцевого буфера по умолчанию и допустимые границы (в байтах).
+// Емкость всегда степень двойки: индекс в буфере получается маской
+#define SCULL_DEFAULT_SIZE 4096
+#define SCULL_MIN_SIZE     4096
+#define SCULL_MAX_SIZE     (512U << 20)
+// Количество устройств, создаваемых при загрузке (два драйвера).
+// Остальные создаются и удаляются через /dev/scull_control
 #define NUM_DEVICES 2
+// Наибольшее число устройств (диапазон minor-номеров)
+#define SCULL_MAX_DEVICES 256
+
+// Режимы работы устройства (битовая маска dev->mode)
+#define SCULL_MODE_SPSC   0x1  // Один писатель и один читатель, без мьютексов
+#define SCULL_MODE_FRAMED 0x2  // Границы записей сохраняются: read() отдает целые записи
+#define SCULL_MODE_BATCH  0x4  // Вместе с FRAMED: read() отдает все целые записи, что влезут
+#define SCULL_MODE_MQ      0x8 // Писатели пишут в кольцо (шард) своего CPU, без общего мьютекса
+#define SCULL_MODE_ORDERED 0x10 // Вместе с MQ: читатели получают записи строго в порядке записи
+#define SCULL_MODE_BROADCAST 0x20 // Каждый читатель получает весь поток через свой курсор
+#define SCULL_MODE_DROP_SLOW 0x40 // Вместе с BROADCAST: писатель отключает отстающих читателей
+#define SCULL_MODE_OVERWRITE 0x80 // "Бортовой самописец": при нехватке места затираются старые данные
+
+// Наибольшее число шардов в режиме MQ (шард на каждый CPU, но не больше)
+#define SCULL_MQ_MAX_SHARDS 64
+
+// В режиме записей перед данными каждой записи в кольце лежит ее длина (u32)
+#define SCULL_FRAME_HDR sizeof(u32)
+// Размер "линии" в управляющей странице. 128 байт покрывают и парную
+// предвыборку соседней линии на x86, и 128-байтные линии на arm64
+#define SCULL_CTRL_LINE 128
+
+// Команды ioctl
+#define SCULL_IOC_GET_SIZE   0  // Получить количество данных в буфере
+#define SCULL_IOC_WAIT_DATA  1  // Ждать, пока в буфере будет >= arg байт
+#define SCULL_IOC_WAIT_SPACE 2  // Ждать, пока в буфере будет >= arg свободных байт
+#define SCULL_IOC_NOTIFY     3  // Разбудить ожидающих после работы через mmap
+#define SCULL_IOC_GET_CAPACITY 4 // Получить емкость кольца
+#define SCULL_IOC_SET_CAPACITY 5 // Изменить емкость кольца (данные сохраняются)
+#define SCULL_IOC_SET_READ_WM  6 // Читатели готовы, когда в буфере >= arg байт
+#define SCULL_IOC_SET_WRITE_WM 7 // Писатели готовы, когда свободно >= arg байт
+#define SCULL_IOC_GET_MODE     8 // Получить режим работы (SCULL_MODE_*)
+#define SCULL_IOC_SET_MODE     9 // Включить/выключить FRAMED, BATCH и OVERWRITE
+#define SCULL_IOC_GET_LOST    10 // Сколько данных затерто в режиме OVERWRITE (struct scull_lost)
+#define SCULL_IOC_SNAPSHOT    11 // Снимок состояния всех устройств (struct scull_snap_req)
+#define SCULL_IOC_SET_BUSY_POLL 12 // Сколько мкс читатель крутится перед сном (0 - не крутится)
+#define SCULL_IOC_RPC_CALL    13 // Клиент: отправить запрос и ждать ответа (struct scull_rpc)
+#define SCULL_IOC_RPC_SERVE   14 // Сервер: ответить на запрос и получить следующий (struct scull_rpc)
+#define SCULL_IOC_EVENTFD     15 // Привязать eventfd к порогу данных или места (struct scull_eventfd)
+
+// Наибольший бюджет busy-poll: дольше крутиться дороже, чем уснуть
+#define SCULL_BUSY_POLL_MAX_US 1000
+// Наибольший размер запроса и ответа в канале запрос-ответ
+#define SCULL_RPC_MAX_MSG (64U << 10)
+
+// Команды управляющего устройства /dev/scull_control
+#define SCULL_CTL_CREATE  0 // Создать кольцо (struct scull_ctl_create), вернет номер устройства
+#define SCULL_CTL_DESTROY 1 // Удалить кольцо с номером arg (оно не должно быть открыто)
+
+// Флаги SCULL_CTL_CREATE
+#define SCULL_CTL_HUGE 0x1 // Кольцо на больших страницах (если оно не меньше PMD_SIZE)
+
+// Узел NUMA "первого писателя": кольцо переезжает на узел процесса,
+// который первым в него пишет
+#define SCULL_NUMA_AUTO (-2)
+
+// Параметры нового кольца для SCULL_CTL_CREATE
+struct scull_ctl_create {
+    s32 minor;                  // Номер устройства, -1 - первый свободный
+    u32 capacity;               // Емкость в байтах, 0 - по умолчанию
+    u32 mode;                   // Режим (SCULL_MODE_*), как у параметров модуля
+    s32 numa_node;              // Узел NUMA: -1 - любой, -2 - узел первого писателя
+    u32 flags;                  // SCULL_CTL_HUGE
+};
+
+// Счетчики потерь режима OVERWRITE. Они только растут: читатель
+// сравнивает значения до и после чтения и так узнает о пропуске
+struct scull_lost {
+    u64 bytes;                  // Сколько байт затерто до прочтения
+    u64 records;                // Сколько целых записей затерто (режим FRAMED)
+};
+
+// Состояние одного устройства в снимке SCULL_IOC_SNAPSHOT
+struct scull_dev_snap {
+    u32 minor;                  // Номер устройства
+    u32 mode;                   // Режим (SCULL_MODE_*)
+    u32 capacity;               // Емкость кольца (всех шардов вместе в режиме MQ)
+    u32 data_size;              // Данных в кольце (во всех шардах в режиме MQ)
+    u32 high_water;             // Наибольшее заполнение за все время
+    u32 read_waiters;           // Сколько читателей спит сейчас
+    u32 write_waiters;          // Сколько писателей спит сейчас
+    u32 pad;
+    u64 bytes_in;               // Счетчики - как в debugfs stats
+    u64 bytes_out;
+    u64 writes;
+    u64 reads;
+    u64 read_blocks;
+    u64 write_blocks;
+    u64 lost_bytes;
+};
+
+// Запрос SCULL_IOC_SNAPSHOT: ядро заполняет до max элементов массива
+// entries и возвращает в nr общее число устройств
+struct scull_snap_req {
+    u64 entries;                // Указатель на массив struct scull_dev_snap
+    u32 max;                    // Размер массива
+    u32 nr;                     // Сколько устройств всего (заполняет ядро)
+};
+
+// Сообщение канала запрос-ответ. Канал есть у каждого устройства и
+// не зависит от кольца.
+// Клиент (RPC_CALL): req/req_len - запрос, reply/reply_len - буфер ответа
+// и его размер; ядро записывает в reply_len длину ответа.
+// Сервер (RPC_SERVE): reply/reply_len - ответ на запрос id (0 - отвечать
+// не на что); req/req_len - буфер под следующий запрос; ядро записывает
+// в req_len его длину, а в id - его номер
+struct scull_rpc {
+    u64 id;                     // Номер запроса
+    u64 req;                    // Указатель на запрос
+    u64 reply;                  // Указатель на ответ
+    u32 req_len;                // Длина запроса
+    u32 reply_len;              // Длина ответа
+};
+
+// События для eventfd
+#define SCULL_EFD_DATA  0 // Данных в кольце стало >= threshold
+#define SCULL_EFD_SPACE 1 // Свободного места стало >= threshold
+#define SCULL_EFD_NR    2
+
+// Привязка eventfd для SCULL_IOC_EVENTFD. Счетчик eventfd растет, когда
+// уровень пересекает порог снизу вверх (по фронту), а не на каждой
+// операции. fd < 0 снимает привязку события
+struct scull_eventfd {
+    s32 fd;                     // Дескриптор eventfd или -1
+    u32 event;                  // SCULL_EFD_DATA или SCULL_EFD_SPACE
+    u32 threshold;              // Порог в байтах, 0 - как 1
+};
+
+// Управляющая страница кольца. Отображается в пространство пользователя
+// по смещению 0, страницы данных идут следом (смещение PAGE_SIZE).
+// head и tail - свободно бегущие счетчики: индекс в буфере равен
+// счетчику по маске size - 1, а объем данных равен head - tail.
+// Каждый счетчик лежит в своей линии, чтобы писатель и читатель
+// не гоняли одну и ту же линию кэша между ядрами.
+struct scull_ring_ctrl {
+    u32 size;                              // Емкость кольца в байтах
+    u32 head __aligned(SCULL_CTRL_LINE);   // Сколько всего байт записано (двигает писатель)
+    u32 tail __aligned(SCULL_CTRL_LINE);   // Сколько всего байт прочитано (двигает читатель)
+};
+
+// Заголовок записи в шарде режима MQ: длина и глобальный номер записи
+struct scull_mq_hdr {
+    u32 len;                    // Длина данных записи
+    u32 seq;                    // Номер записи (только в режиме ORDERED)
+};
+
+// Шард режима MQ: отдельное кольцо со своим мьютексом писателей.
+// Емкость устройства делится между шардами (dev->shard_size).
+// head двигают писатели шарда, tail - читатели устройства (под read_lock), поэтому они в разных линиях
+struct scull_shard {
+    struct mutex lock;          // Сериализует писателей этого шарда
+    char *buffer;               // Кольцевой буфер шарда
+    u32 head;                   // Сколько всего байт записано в шард
+    u32 tail ____cacheline_aligned_in_smp; // Сколько всего байт прочитано из шарда
+} ____cacheline_aligned_in_smp;
+
+// Гистограммы устройства с корзинами по степеням двойки: корзина i
+// считает значения из [2^(i-1), 2^i), корзина 0 - нули
+#define SCULL_HIST_BUCKETS 32
+enum {
+    SCULL_HIST_READ_WAIT,       // Сколько читатель спал в очереди (нс)
+    SCULL_HIST_WRITE_WAIT,      // Сколько писатель спал в очереди (нс)
+    SCULL_HIST_READ_HOLD,       // Сколько читатель держал мьютекс на копирование (нс)
+    SCULL_HIST_WRITE_HOLD,      // Сколько писатель держал мьютекс на копирование (нс)
+    SCULL_HIST_OCCUPANCY,       // Заполнение кольца после каждой операции (байты)
+    SCULL_HIST_WAKE_LAT,        // От публикации данных до запуска проснувшегося читателя (нс)
+    SCULL_HIST_SPIN_LAT,        // От публикации данных до того, как их увидел спин (нс)
+    SCULL_HIST_NR
+};
+
+// Статистика устройства. Счетчики ведутся на каждом CPU отдельно, чтобы
+// читатели и писатели не гоняли общую линию кэша; debugfs их суммирует
+struct scull_stats {
+    u64 bytes_in;               // Сколько байт записано
+    u64 bytes_out;              // Сколько байт прочитано
+    u64 writes;                 // Сколько операций записи
+    u64 reads;                  // Сколько операций чтения
+    u64 read_blocks;            // Сколько раз читатель уходил спать
+    u64 write_blocks;           // Сколько раз писатель уходил спать
+    u64 busy_poll_hits;         // Спин дождался данных, сна не было
+    u64 busy_poll_misses;       // Бюджет спина кончился, читатель уснул
+};
+
+// Гистограммы SCULL_HIST_* одного CPU
+struct scull_hist {
+    u64 bucket[SCULL_HIST_NR][SCULL_HIST_BUCKETS];
+};
+
+// Вызов в канале запрос-ответ. Сначала лежит в rpc_pending, потом, когда
+// его забрал сервер, - в rpc_active. Освобождает клиент после ответа,
+// а если клиента прервали сигналом - сервер
+struct scull_rpc_call {
+    struct list_head node;      // Элемент rpc_pending или rpc_active
+    u64 id;                     // Номер вызова
+    struct file *server;        // Сервер, который забрал запрос
+    void *req;                  // Запрос (копия в ядре)
+    u32 req_len;
+    void *reply;                // Ответ (копия в ядре)
+    u32 reply_len;
+    int status;                 // 0 или ошибка (-EPIPE, если сервер закрыл файл)
+    bool done;                  // Ответ готов
+    bool abandoned;             // Клиент ушел, ответ никому не нужен
+    wait_queue_head_t wait;     // Здесь клиент ждет ответа
+};
+
+// Привязанный eventfd одного события
+struct scull_efd {
+    struct eventfd_ctx *ctx;    // Контекст eventfd или NULL
+    struct file *owner;         // Файл, через который привязали (снимается при закрытии)
+    u32 threshold;              // Порог в байтах
+};
 
-// Структура данных для каждого устройства
+// Курсор читателя в режиме BROADCAST. Писатель пишет поток один раз,
+// а каждый открытый на чтение файл читает его со своей позиции
+struct scull_cursor {
+    struct list_head node;      // Элемент списка dev->cursors
+    struct file *filp;          // Файл читателя
+    u32 pos;                    // Сколько байт потока прочитал этот читатель
+    bool dropped;               // Отключен писателем за отставание
+};
+
+// Структура данных для каждого устройства.
+// Поля читателя и писателя разнесены по разным линиям кэша:
+// при одном писателе и одном читателе каждая сторона трогает только свою
 struct scull_buffer {
-    struct cdev cdev;           // Структура символьного устройства
+    struct cdev *cdev;          // Символьное устройство. Отдельный объект: открытые
+                                // файлы держат ссылку на него дольше, чем живет
+                                // scull_buffer, и cdev освобождается сам по последней ссылке
     dev_t devno;                // Номер устройства (major + minor)
+    unsigned int users;         // Сколько раз открыто (под scull_devices_lock)
     char *buffer;               // Указатель на кольцевой буфер в памяти ядра
-    int read_index;             // Индекс для чтения из буфера
-    int write_index;            // Индекс для записи в буфер
-    int data_size;              // Текущее количество данных в буфере
-    struct mutex lock;          // Мьютекс для защиты от гонок данных
+    u32 size;                   // Емкость буфера (степень двойки)
+    u32 mask;                   // size - 1, для вычисления индекса
+    int numa_node;              // Узел NUMA памяти кольца (NUMA_NO_NODE - любой)
+    bool numa_auto;             // Переехать на узел первого писателя
+    bool huge;                  // Кольцо на больших страницах
+    struct scull_ring_ctrl *ctrl; // Управляющая страница с индексами head/tail
+    unsigned int mode;          // Режим работы (SCULL_MODE_*)
+    atomic_t mmap_count;        // Количество активных отображений mmap
+    struct mutex lock;          // Мьютекс для настройки устройства (ioctl, mmap)
+    seqcount_mutex_t cfg_seq;   // Смена емкости и режима (пишется под lock) для снимков
+    struct scull_shard *shards; // Шарды режима MQ
+    unsigned int nr_shards;     // Количество шардов
+    u32 shard_size;             // Емкость шарда: доля емкости устройства, степень двойки
+    u32 shard_mask;             // shard_size - 1
+    spinlock_t cursor_lock;     // Защищает список курсоров режима BROADCAST
+    struct list_head cursors;   // Курсоры читателей режима BROADCAST
+    struct scull_stats __percpu *stats; // Статистика операций
+    struct scull_hist __percpu *hist;   // Гистограммы
+    struct dentry *debugfs;     // Каталог устройства в debugfs
+    struct mutex rpc_lock;      // Защищает очереди вызовов канала запрос-ответ
+    struct list_head rpc_pending; // Запросы, которые еще не забрал сервер
+    struct list_head rpc_active;  // Запросы, на которые сервер еще не ответил
+    wait_queue_head_t rpc_queue;  // Здесь серверы ждут запросов
+    u64 rpc_next_id;            // Номер последнего вызова
+    spinlock_t efd_lock;        // Защищает привязки eventfd
+    struct scull_efd efd[SCULL_EFD_NR]; // eventfd для событий SCULL_EFD_*
+
+    // Сторона читателя
+    struct mutex read_lock ____cacheline_aligned_in_smp; // Сериализует читателей
+    struct file *reader;        // Единственный читатель в режиме SPSC
+    unsigned long reader_busy;  // Бит 0 - читатель SPSC внутри операции
+    u32 read_wm;                // Порог данных для пробуждения читателей
+    u32 busy_poll_us;           // Бюджет спина читателя перед сном (мкс)
+    unsigned int mq_rr;         // С какого шарда читатели начнут обход
+    u32 mq_next_seq;            // Номер следующей записи в режиме ORDERED
+    atomic_t read_waiters;      // Сколько читателей спит в read_queue
     wait_queue_head_t read_queue;   // Очередь ожидания для процессов чтения
+
+    // Сторона писателя
+    struct mutex write_lock ____cacheline_aligned_in_smp; // Сериализует писателей
+    struct file *writer;        // Единственный писатель в режиме SPSC
+    unsigned long writer_busy;  // Бит 0 - писатель SPSC внутри операции
+    u32 write_wm;               // Порог свободного места для пробуждения писателей
+    atomic64_t lost_bytes;      // Затерто байт в режиме OVERWRITE
+    atomic64_t lost_records;    // Затерто записей в режиме OVERWRITE
+    u32 high_water;             // Наибольшее заполнение кольца за все время
+    atomic_t write_waiters;     // Сколько писателей спит в write_queue
+    u64 publish_ns;             // Когда писатель последний раз опубликовал данные
+    atomic_t mq_seq;            // Последний выданный номер записи в режиме ORDERED
     wait_queue_head_t write_queue;  // Очередь ожидания для процессов записи
 };
 
-// Массив структур устройств (два драйвера)
-static struct scull_buffer devices[NUM_DEVICES];
+// Устройства по minor-номерам. Пустые ячейки - свободные номера.
+// Таблица и счетчики открытий защищены scull_devices_lock
+static struct scull_buffer *devices[SCULL_MAX_DEVICES];
+static DEFINE_MUTEX(scull_devices_lock);
 // Старший номер устройства (будет назначен динамически)
 static int major_num = 0;
+// Корневой каталог драйвера в debugfs
+static struct dentry *scull_debugfs;
 // Класс устройств для sysfs
 static struct class *scull_class = NULL;
 
+// Режим SPSC для каждого устройства: spsc=1,0 включает его для scull_buffer0.
+// В этом режиме read()/write() не берут мьютексы, а индексы публикуются
+// с acquire/release. Второй читатель или писатель получит -EBUSY - даже
+// если это другой поток с тем же дескриптором, пока первый внутри вызова
+static bool spsc[NUM_DEVICES];
+module_param_array(spsc, bool, NULL, 0444);
+MODULE_PARM_DESC(spsc, "Single-producer/single-consumer lock-free mode per device");
+
+// Начальная емкость каждого устройства, округляется вверх до степени двойки.
+// 0 - размер по умолчанию. Потом емкость меняется через SCULL_IOC_SET_CAPACITY
+static unsigned int buffer_size[NUM_DEVICES];
+module_param_array(buffer_size, uint, NULL, 0444);
+MODULE_PARM_DESC(buffer_size, "Initial ring capacity in bytes per device (4 KiB - 512 MiB)");
+
+// Режим MQ для каждого устройства: каждый CPU пишет в свой шард, и
+// пропускная способность писателей растет с числом ядер.
+// 0 - выключен, 1 - читатели обходят шарды по кругу,
+// 2 - читатели получают записи строго в порядке записи (по номерам).
+// Режим задается при загрузке и имеет приоритет над spsc
+static unsigned int mq[NUM_DEVICES];
+module_param_array(mq, uint, NULL, 0444);
+MODULE_PARM_DESC(mq, "Per-CPU write shards per device: 0 - off, 1 - round-robin reads, 2 - strict write order");
+
+// Режим BROADCAST для каждого устройства: один писатель, много читателей,
+// каждый читатель получает весь поток. Писатель ждет самого медленного.
+// 0 - выключен, 1 - писатель ждет, 2 - писатель отключает отстающих
+// читателей (их read() вернет -EPIPE). Приоритет ниже mq, но выше spsc.
+// Открыть такое устройство O_RDWR нельзя (-EINVAL): писатель - O_WRONLY
+static unsigned int broadcast[NUM_DEVICES];
+module_param_array(broadcast, uint, NULL, 0444);
+MODULE_PARM_DESC(broadcast, "Broadcast ring per device: 0 - off, 1 - gate writer on slowest reader, 2 - drop slow readers");
+
+// Узел NUMA памяти каждого устройства: -1 - любой, -2 - узел первого
+// писателя (кольцо переезжает при первой записи). Писатели и читатели
+// на другом узле платят за каждую линию кэша межсокетным переходом.
+// Массив назван ring_node: имя numa_node занято per-CPU переменной ядра
+// (linux/topology.h), параметр модуля при этом называется numa_node
+static int ring_node[NUM_DEVICES] = { [0 ... NUM_DEVICES - 1] = NUMA_NO_NODE };
+module_param_array_named(numa_node, ring_node, int, NULL, 0444);
+MODULE_PARM_DESC(numa_node, "NUMA node for ring memory per device: -1 - any, -2 - first writer's node");
+
+// Большие страницы для памяти кольца: меньше промахов TLB при
+// копировании. Действует для колец от PMD_SIZE (2 МиБ на x86).
+// Узел NUMA важнее: если память нужна на другом узле, чем у CPU, который
+// ее выделяет, кольцо (или шард MQ) получает обычные страницы
+static bool huge_pages[NUM_DEVICES];
+module_param_array(huge_pages, bool, NULL, 0444);
+MODULE_PARM_DESC(huge_pages, "Back rings of at least PMD_SIZE with huge pages per device");
+
 // Объявления функций файловых операций (предварительные объявления)
 static int scull_open(struct inode *inode, struct file *filp);
 static int scull_release(struct inode *inode, struct file *filp);
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
-static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t scull_poll(struct file *filp, poll_table *wait);
+static long scull_snapshot(unsigned long arg);
+static int scull_resize_ring(struct scull_buffer *dev, unsigned long new_size);
+static u32 scull_mq_data_size(struct scull_buffer *dev);
 
 // Структура файловых операций - связывает системные вызовы с нашими функциями
 static struct file_operations scull_fops = {
     .owner = THIS_MODULE,    // Владелец модуля (предотвращает выгрузку при использовании)
     .open = scull_open,      // Вызывается при open() из пользовательского пространства
     .release = scull_release, // Вызывается при close() из пользовательского пространства
-    .read = scull_read,      // Вызывается при read() из пользовательского пространства
-    .write = scull_write,    // Вызывается при write() из пользовательского пространства
-    .unlocked_ioctl = scull_ioctl
+    .read_iter = scull_read_iter,   // Вызывается при read()/readv()/io_uring из пользовательского пространства
+    .write_iter = scull_write_iter, // Вызывается при write()/writev()/io_uring из пользовательского пространства
+    .unlocked_ioctl = scull_ioctl,
+    .mmap = scull_mmap,      // Вызывается при mmap() из пользовательского пространства
+    .poll = scull_poll,      // Вызывается при poll()/select()/epoll из пользовательского пространства
+    // splice()/sendfile(): данные идут между кольцом и каналом (pipe) через
+    // read_iter/write_iter, минуя буфер в пространстве пользователя.
+    // Пачка страниц канала переносится за один захват мьютекса стороны
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write
 };
 
+// Количество данных в буфере. head публикуется писателем с release-семантикой,
+// поэтому читаем его с acquire: все байты до head уже видны в buffer.
+// Счетчики могут двигать и процессы через mmap, поэтому мьютекс тут не нужен
+static inline u32 scull_data_size(struct scull_buffer *dev)
+{
+    return smp_load_acquire(&dev->ctrl->head) - smp_load_acquire(&dev->ctrl->tail);
+}
+
+// Свободное место в буфере
+static inline u32 scull_space_available(struct scull_buffer *dev)
+{
+    return READ_ONCE(dev->size) - scull_data_size(dev);
+}
+
+// Пороги готовности. Если емкость уменьшили ниже порога,
+// порогом считается вся емкость, чтобы никто не ждал вечно
+static inline u32 scull_read_lowat(struct scull_buffer *dev)
+{
+    return min(READ_ONCE(dev->read_wm), READ_ONCE(dev->size));
+}
+
+static inline u32 scull_write_lowat(struct scull_buffer *dev)
+{
+    return min(READ_ONCE(dev->write_wm), READ_ONCE(dev->size));
+}
+
+// Сколько свободного места нужно писателю, чтобы начать запись count байт.
+// Запись в режиме FRAMED не делится, ей нужно место целиком
+static inline u32 scull_write_need(struct scull_buffer *dev, size_t count)
+{
+    if (dev->mode & SCULL_MODE_FRAMED)
+        return count + SCULL_FRAME_HDR;
+    return max_t(u32, min_t(size_t, count, scull_write_lowat(dev)), 1);
+}
+
+// Запись режима FRAMED, которая не поместится даже в пустое кольцо.
+// Емкость может уменьшиться, пока писатель ждет места
+static inline bool scull_frame_too_big(struct scull_buffer *dev, size_t count)
+{
+    return (READ_ONCE(dev->mode) & SCULL_MODE_FRAMED) &&
+           count > READ_ONCE(dev->size) - SCULL_FRAME_HDR;
+}
+
+// Вход на одну сторону кольца (чтение или запись).
+// В режиме SPSC файл, первым начавший операции, закрепляется за стороной
+// и работает без мьютекса; остальным файлам возвращается -EBUSY.
+// Файл - не поток: его могут делить потоки процесса или потомок после
+// fork(). Поэтому сторона еще и помечается занятой на время операции
+// (бит busy), и вторая одновременная операция того же файла тоже
+// получает -EBUSY, а не портит head/tail.
+// Иначе операции стороны сериализуются ее собственным мьютексом,
+// так что читатели и писатели никогда не ждут друг друга.
+// При nowait (IOCB_NOWAIT) занятый мьютекс не ждем, а возвращаем -EAGAIN.
+// Возвращает true, если мьютекс захвачен, или код ошибки
+static int scull_side_lock(struct scull_buffer *dev, struct file *filp,
+                           struct mutex *lock, struct file **owner,
+                           unsigned long *busy, bool nowait)
+{
+    if (dev->mode & SCULL_MODE_SPSC) {
+        if (READ_ONCE(*owner) != filp && cmpxchg(owner, NULL, filp))
+            return -EBUSY;
+        // Одна атомарная операция вместо мьютекса; acquire - как у мьютекса
+        if (test_and_set_bit_lock(0, busy))
+            return -EBUSY;
+        return false;
+    }
+
+    if (nowait)
+        return mutex_trylock(lock) ? true : -EAGAIN;
+    if (mutex_lock_interruptible(lock))
+        return -ERESTARTSYS; // Процесс был прерван сигналом
+    return true;
+}
+
+// Не блокироваться: O_NONBLOCK у файла или IOCB_NOWAIT у запроса
+// (io_uring сначала пробует так, чтобы не уводить запрос в рабочий поток)
+static inline bool scull_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static inline void scull_side_unlock(struct mutex *lock, unsigned long *busy, int locked)
+{
+    if (locked)
+        mutex_unlock(lock);
+    else
+        clear_bit_unlock(0, busy); // Режим SPSC
+}
+
+// Будим другую сторону, только если там кто-то спит.
+// wq_has_sleeper содержит барьер, парный с барьером в wait_event:
+// новый head/tail виден ожидающему до проверки условия.
+// Читатели (кроме BROADCAST) и писатели побайтового кольца спят
+// эксклюзивно: просыпается один, а не все сразу, чтобы не толкаться
+// за мьютексом. Проснувшийся, если после него осталось что читать (или
+// куда писать), будит следующего - пробуждение идет по цепочке.
+// poll() и ожидания mmap-процессов не эксклюзивны и будятся всегда
+static inline void scull_wake(wait_queue_head_t *queue)
+{
+    if (wq_has_sleeper(queue))
+        wake_up_interruptible(queue);
+}
+
+// Поиск курсора файла. Вызывается под cursor_lock
+static struct scull_cursor *scull_bcast_cursor(struct scull_buffer *dev, struct file *filp)
+{
+    struct scull_cursor *cursor;
+
+    list_for_each_entry(cursor, &dev->cursors, node) {
+        if (cursor->filp == filp)
+            return cursor;
+    }
+    return NULL;
+}
+
+// Пересчет tail в режиме BROADCAST: место освобождается только тогда,
+// когда байт прочитали все подключенные читатели. Если читателей нет,
+// данные остаются для следующего читателя. Вызывается под cursor_lock.
+// Возвращает false, если подключенных читателей нет
+static bool scull_bcast_update_tail(struct scull_buffer *dev)
+{
+    u32 tail = dev->ctrl->tail;
+    u32 lag = smp_load_acquire(&dev->ctrl->head) - tail; // Отставание самого медленного
+    struct scull_cursor *cursor;
+    bool live = false;
+
+    list_for_each_entry(cursor, &dev->cursors, node) {
+        if (cursor->dropped)
+            continue;
+        lag = min(lag, cursor->pos - tail);
+        live = true;
+    }
+
+    if (live && lag)
+        smp_store_release(&dev->ctrl->tail, tail + lag);
+    return live;
+}
+
+// Политика DROP_SLOW: вместо сна писатель отключает самых медленных
+// читателей, пока не освободится need байт. Если отключены все,
+// накопленные данные больше никому не нужны и отбрасываются.
+// Возвращает true, если место освободилось
+static bool scull_bcast_drop_slow(struct scull_buffer *dev, u32 need)
+{
+    struct scull_cursor *cursor, *slowest;
+    bool dropped = false;
+    u32 tail;
+
+    spin_lock(&dev->cursor_lock);
+    while (scull_space_available(dev) < need) {
+        tail = dev->ctrl->tail;
+        slowest = NULL;
+        list_for_each_entry(cursor, &dev->cursors, node) {
+            if (!cursor->dropped && (!slowest || cursor->pos - tail < slowest->pos - tail))
+                slowest = cursor;
+        }
+        if (!slowest)
+            break; // Читателей нет - отключать некого, писатель будет ждать
+
+        slowest->dropped = true;
+        dropped = true;
+        if (!scull_bcast_update_tail(dev))
+            smp_store_release(&dev->ctrl->tail, smp_load_acquire(&dev->ctrl->head));
+    }
+    spin_unlock(&dev->cursor_lock);
+
+    if (dropped) {
+        pr_info("scull_buffer: Slow readers dropped by process %d (%s)\n",
+                current->pid, current->comm);
+        // Отключенные читатели должны узнать об этом и получить -EPIPE
+        wake_up_interruptible_all(&dev->read_queue);
+    }
+    return dropped;
+}
+
+// Добавление значения в гистограмму текущего CPU
+static inline void scull_hist_add(struct scull_buffer *dev, int hist, u64 val)
+{
+    this_cpu_inc(dev->hist->bucket[hist][min(fls64(val), SCULL_HIST_BUCKETS - 1)]);
+}
+
+// Учет записи: счетчики, высшая отметка заполнения и точка трассировки.
+// Текст не форматируется, пока трассировка выключена
+static inline void scull_account_write(struct scull_buffer *dev, size_t bytes, u32 data_size)
+{
+    u32 hw = READ_ONCE(dev->high_water);
+
+    this_cpu_add(dev->stats->bytes_in, bytes);
+    this_cpu_inc(dev->stats->writes);
+    // Отметку трогаем, только когда она побита, - обычно это одно чтение
+    while (data_size > hw) {
+        u32 old = cmpxchg(&dev->high_water, hw, data_size);
+
+        if (old == hw)
+            break;
+        hw = old;
+    }
+    scull_hist_add(dev, SCULL_HIST_OCCUPANCY, data_size);
+    // Отметка времени нужна только для гистограмм задержки пробуждения
+    if (READ_ONCE(dev->busy_poll_us) || atomic_read(&dev->read_waiters))
+        WRITE_ONCE(dev->publish_ns, ktime_get_ns());
+    trace_scull_enqueue(MINOR(dev->devno), bytes, data_size);
+}
+
+// Учет чтения
+static inline void scull_account_read(struct scull_buffer *dev, size_t bytes, u32 data_size)
+{
+    this_cpu_add(dev->stats->bytes_out, bytes);
+    this_cpu_inc(dev->stats->reads);
+    scull_hist_add(dev, SCULL_HIST_OCCUPANCY, data_size);
+    trace_scull_dequeue(MINOR(dev->devno), bytes, data_size);
+}
+
+// Уровень события: данных в кольце или свободного места
+static u32 scull_efd_level(struct scull_buffer *dev, unsigned int event)
+{
+    if (dev->mode & SCULL_MODE_MQ)
+        return scull_mq_data_size(dev); // Только SCULL_EFD_DATA
+    return event == SCULL_EFD_DATA ? scull_data_size(dev) : scull_space_available(dev);
+}
+
+// Сигнал в eventfd события. Вызывается под efd_lock: привязку не
+// снимут, пока мы держим ее контекст
+static void scull_efd_signal(struct scull_efd *efd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(efd->ctx);
+#else
+    eventfd_signal(efd->ctx, 1);
+#endif
+}
+
+// Уровень события вырос на delta и стал level. Сигнал уходит, только если
+// уровень пересек порог снизу вверх. Без привязки это одно чтение указателя
+static inline void scull_efd_edge(struct scull_buffer *dev, unsigned int event,
+                                  u32 level, u32 delta)
+{
+    struct scull_efd *efd = &dev->efd[event];
+    u32 threshold;
+
+    if (!READ_ONCE(efd->ctx))
+        return;
+    // Порог выше емкости после ее уменьшения - считаем порогом всю емкость
+    threshold = min(READ_ONCE(efd->threshold), READ_ONCE(dev->size));
+    if (level < threshold || level - min(level, delta) >= threshold)
+        return;
+
+    spin_lock(&dev->efd_lock);
+    if (efd->ctx)
+        scull_efd_signal(efd);
+    spin_unlock(&dev->efd_lock);
+}
+
+// Сигнал, если уровень уже не ниже порога: после привязки и после
+// SCULL_IOC_NOTIFY, когда индексы сдвинули через mmap
+static void scull_efd_check(struct scull_buffer *dev, unsigned int event)
+{
+    struct scull_efd *efd = &dev->efd[event];
+    u32 level = scull_efd_level(dev, event);
+
+    spin_lock(&dev->efd_lock);
+    if (efd->ctx && level >= min(efd->threshold, READ_ONCE(dev->size)))
+        scull_efd_signal(efd);
+    spin_unlock(&dev->efd_lock);
+}
+
+// Привязка или снятие eventfd (SCULL_IOC_EVENTFD)
+static long scull_efd_bind(struct scull_buffer *dev, struct file *filp,
+                           struct scull_eventfd __user *uarg)
+{
+    struct scull_eventfd req;
+    struct eventfd_ctx *ctx = NULL, *old;
+    struct scull_efd *efd;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    if (req.event >= SCULL_EFD_NR || req.threshold > SCULL_MAX_SIZE)
+        return -EINVAL;
+    // В режиме MQ место у каждого шарда свое, общего порога места нет
+    if (req.event == SCULL_EFD_SPACE && (dev->mode & SCULL_MODE_MQ))
+        return -EOPNOTSUPP;
+    if (req.fd >= 0) {
+        ctx = eventfd_ctx_fdget(req.fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    efd = &dev->efd[req.event];
+    spin_lock(&dev->efd_lock);
+    old = efd->ctx;
+    efd->owner = filp;
+    efd->threshold = max_t(u32, req.threshold, 1);
+    WRITE_ONCE(efd->ctx, ctx);
+    spin_unlock(&dev->efd_lock);
+    // Старый контекст отпускаем вне спинлока
+    if (old)
+        eventfd_ctx_put(old);
+
+    // Порог уже достигнут - фронта не будет, сигналим сразу
+    if (ctx)
+        scull_efd_check(dev, req.event);
+    return 0;
+}
+
+// Файл закрыт: снимаем привязки, сделанные через него
+static void scull_efd_release(struct scull_buffer *dev, struct file *filp)
+{
+    struct eventfd_ctx *ctx[SCULL_EFD_NR] = { NULL };
+    int i;
+
+    spin_lock(&dev->efd_lock);
+    for (i = 0; i < SCULL_EFD_NR; i++) {
+        if (dev->efd[i].ctx && dev->efd[i].owner == filp) {
+            ctx[i] = dev->efd[i].ctx;
+            WRITE_ONCE(dev->efd[i].ctx, NULL);
+            dev->efd[i].owner = NULL;
+        }
+    }
+    spin_unlock(&dev->efd_lock);
+    for (i = 0; i < SCULL_EFD_NR; i++) {
+        if (ctx[i])
+            eventfd_ctx_put(ctx[i]);
+    }
+}
+
+// Учет ухода процесса в сон (writer - писатель, иначе читатель).
+// Возвращает время начала сна для scull_account_wakeup, который
+// вызывается после сна всегда, даже если его прервал сигнал
+static inline u64 scull_account_sleep(struct scull_buffer *dev, bool writer)
+{
+    if (writer) {
+        this_cpu_inc(dev->stats->write_blocks);
+        atomic_inc(&dev->write_waiters);
+    } else {
+        this_cpu_inc(dev->stats->read_blocks);
+        atomic_inc(&dev->read_waiters);
+    }
+    trace_scull_sleep(MINOR(dev->devno), writer);
+    return ktime_get_ns();
+}
+
+// Учет пробуждения: сколько процесс проспал
+static inline void scull_account_wakeup(struct scull_buffer *dev, bool writer, u64 slept)
+{
+    atomic_dec(writer ? &dev->write_waiters : &dev->read_waiters);
+    if (!writer)
+        scull_hist_add(dev, SCULL_HIST_WAKE_LAT,
+                       max_t(s64, ktime_get_ns() - READ_ONCE(dev->publish_ns), 0));
+    scull_hist_add(dev, writer ? SCULL_HIST_WRITE_WAIT : SCULL_HIST_READ_WAIT,
+                   ktime_get_ns() - slept);
+    trace_scull_wakeup(MINOR(dev->devno), writer);
+}
+
+// Учет спина читателя: дождался ли он данных без сна
+static inline void scull_account_spin(struct scull_buffer *dev, bool hit)
+{
+    if (hit) {
+        this_cpu_inc(dev->stats->busy_poll_hits);
+        scull_hist_add(dev, SCULL_HIST_SPIN_LAT,
+                       max_t(s64, ktime_get_ns() - READ_ONCE(dev->publish_ns), 0));
+    } else {
+        this_cpu_inc(dev->stats->busy_poll_misses);
+    }
+}
+
+// Режим busy-poll: перед сном читатель до busy_poll_us мкс проверяет
+// условие в цикле. Так пропадают пробуждение и переключение контекста,
+// которые в обмене запрос-ответ стоят больше самой передачи. Спин
+// прерывается, если CPU нужен планировщику или пришел сигнал.
+// Возвращает true, если условие выполнилось и спать не нужно
+#define scull_busy_poll(dev, cond)                                      \
+({                                                                      \
+    u32 __us = READ_ONCE((dev)->busy_poll_us);                          \
+    bool __ok = false;                                                  \
+                                                                        \
+    if (__us) {                                                         \
+        u64 __end = local_clock() + (u64)__us * NSEC_PER_USEC;          \
+                                                                        \
+        while (!(__ok = (cond)) && local_clock() < __end &&             \
+               !need_resched() && !signal_pending(current))             \
+            cpu_relax();                                                \
+        scull_account_spin(dev, __ok);                                  \
+    }                                                                   \
+    __ok;                                                               \
+})
+
+// Учет времени удержания мьютекса стороны, начиная с hold
+static inline void scull_account_hold(struct scull_buffer *dev, bool writer, u64 hold)
+{
+    scull_hist_add(dev, writer ? SCULL_HIST_WRITE_HOLD : SCULL_HIST_READ_HOLD,
+                   ktime_get_ns() - hold);
+}
+
+// Сумма счетчиков по всем CPU. Счетчики читаются без
+// блокировок, поэтому сумма может чуть отставать от идущих операций
+static void scull_stats_sum(struct scull_buffer *dev, struct scull_stats *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        struct scull_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+        sum->bytes_in += READ_ONCE(st->bytes_in);
+        sum->bytes_out += READ_ONCE(st->bytes_out);
+        sum->writes += READ_ONCE(st->writes);
+        sum->reads += READ_ONCE(st->reads);
+        sum->read_blocks += READ_ONCE(st->read_blocks);
+        sum->write_blocks += READ_ONCE(st->write_blocks);
+        sum->busy_poll_hits += READ_ONCE(st->busy_poll_hits);
+        sum->busy_poll_misses += READ_ONCE(st->busy_poll_misses);
+    }
+}
+
+// Освобождение вызова канала запрос-ответ
+static void scull_rpc_free(struct scull_rpc_call *call)
+{
+    kfree(call->req);
+    kfree(call->reply);
+    kfree(call);
+}
+
+// Завершение вызова с ответом или ошибкой. Вызывается под rpc_lock:
+// клиент берет rpc_lock перед тем, как освободить вызов, поэтому
+// пробуждение не обращается к освобожденной памяти
+static void scull_rpc_finish(struct scull_rpc_call *call, int status)
+{
+    list_del(&call->node);
+    if (call->abandoned) {
+        scull_rpc_free(call); // Клиент уже ушел
+        return;
+    }
+    call->status = status;
+    WRITE_ONCE(call->done, true);
+    // sync: сервер сейчас уснет в ожидании следующего запроса, пусть
+    // клиент сразу займет его CPU
+    wake_up_interruptible_sync(&call->wait);
+}
+
+// Клиент: отправить запрос и ждать ответа - один системный вызов на обмен
+static long scull_rpc_call(struct scull_buffer *dev, struct scull_rpc __user *urpc)
+{
+    struct scull_rpc_call *call;
+    struct scull_rpc rpc;
+    long retval;
+
+    if (copy_from_user(&rpc, urpc, sizeof(rpc)))
+        return -EFAULT;
+    if (rpc.req_len > SCULL_RPC_MAX_MSG)
+        return -EMSGSIZE;
+
+    call = kzalloc(sizeof(*call), GFP_KERNEL);
+    if (!call)
+        return -ENOMEM;
+    call->req = memdup_user(u64_to_user_ptr(rpc.req), rpc.req_len);
+    if (IS_ERR(call->req)) {
+        retval = PTR_ERR(call->req);
+        kfree(call);
+        return retval;
+    }
+    call->req_len = rpc.req_len;
+    init_waitqueue_head(&call->wait);
+
+    mutex_lock(&dev->rpc_lock);
+    call->id = ++dev->rpc_next_id;
+    list_add_tail(&call->node, &dev->rpc_pending);
+    mutex_unlock(&dev->rpc_lock);
+
+    // Будим одного сервера. sync: клиент сейчас уснет, и сервер
+    // запустится на его CPU без миграции
+    wake_up_interruptible_sync(&dev->rpc_queue);
+
+    wait_event_interruptible(call->wait, READ_ONCE(call->done));
+
+    mutex_lock(&dev->rpc_lock);
+    if (!call->done) {
+        // Прервали сигналом. Забранный сервером запрос освободит сервер.
+        // Его уже исполняют, поэтому -EINTR: при SA_RESTART ядро
+        // повторило бы ioctl, и сервер получил бы запрос второй раз
+        if (call->server) {
+            call->abandoned = true;
+            mutex_unlock(&dev->rpc_lock);
+            return -EINTR;
+        }
+        // Запрос никто не видел - вызов можно перезапустить
+        list_del(&call->node);
+        mutex_unlock(&dev->rpc_lock);
+        scull_rpc_free(call);
+        return -ERESTARTSYS;
+    }
+    mutex_unlock(&dev->rpc_lock);
+
+    // Вызов снят со списков и принадлежит только клиенту
+    retval = call->status;
+    if (!retval) {
+        if (call->reply_len > rpc.reply_len)
+            retval = -EMSGSIZE; // В reply_len - сколько нужно
+        else if (copy_to_user(u64_to_user_ptr(rpc.reply), call->reply, call->reply_len))
+            retval = -EFAULT;
+        if (put_user(call->reply_len, &urpc->reply_len))
+            retval = -EFAULT;
+    }
+    scull_rpc_free(call);
+    return retval;
+}
+
+// Сервер: ответить на запрос rpc.id (если он не 0) и получить следующий.
+// Ответ и прием следующего запроса - один системный вызов на обмен
+static long scull_rpc_serve(struct scull_buffer *dev, struct file *filp,
+                            struct scull_rpc __user *urpc)
+{
+    struct scull_rpc_call *call;
+    struct scull_rpc rpc;
+    void *reply;
+
+    if (copy_from_user(&rpc, urpc, sizeof(rpc)))
+        return -EFAULT;
+
+    if (rpc.id) {
+        if (rpc.reply_len > SCULL_RPC_MAX_MSG)
+            return -EMSGSIZE;
+        reply = memdup_user(u64_to_user_ptr(rpc.reply), rpc.reply_len);
+        if (IS_ERR(reply))
+            return PTR_ERR(reply);
+
+        mutex_lock(&dev->rpc_lock);
+        list_for_each_entry(call, &dev->rpc_active, node) {
+            if (call->id == rpc.id && call->server == filp)
+                break;
+        }
+        if (list_entry_is_head(call, &dev->rpc_active, node)) {
+            mutex_unlock(&dev->rpc_lock);
+            kfree(reply);
+            return -ENOENT; // Такого запроса этот сервер не получал
+        }
+        call->reply = reply;
+        call->reply_len = rpc.reply_len;
+        scull_rpc_finish(call, 0);
+        mutex_unlock(&dev->rpc_lock);
+    }
+
+    // Ждем следующий запрос. Серверы спят в эксклюзивном режиме:
+    // на каждый запрос просыпается один
+    for (;;) {
+        mutex_lock(&dev->rpc_lock);
+        call = list_first_entry_or_null(&dev->rpc_pending, struct scull_rpc_call, node);
+        if (call)
+            break;
+        mutex_unlock(&dev->rpc_lock);
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible_exclusive(dev->rpc_queue,
+                                               !list_empty_careful(&dev->rpc_pending)))
+            return -ERESTARTSYS;
+    }
+
+    if (call->req_len > rpc.req_len) {
+        // Запрос остается в очереди, в req_len - сколько нужно места
+        mutex_unlock(&dev->rpc_lock);
+        return put_user(call->req_len, &urpc->req_len) ? -EFAULT : -EMSGSIZE;
+    }
+    // Пока вызов в rpc_active и за этим сервером, клиент его не освободит
+    list_move_tail(&call->node, &dev->rpc_active);
+    call->server = filp;
+    mutex_unlock(&dev->rpc_lock);
+
+    if (copy_to_user(u64_to_user_ptr(rpc.req), call->req, call->req_len) ||
+        put_user(call->req_len, &urpc->req_len) || put_user(call->id, &urpc->id)) {
+        mutex_lock(&dev->rpc_lock);
+        scull_rpc_finish(call, -EFAULT);
+        mutex_unlock(&dev->rpc_lock);
+        return -EFAULT;
+    }
+    return 0;
+}
+
+// Сервер закрыл файл: его клиенты получат -EPIPE
+static void scull_rpc_release(struct scull_buffer *dev, struct file *filp)
+{
+    struct scull_rpc_call *call, *tmp;
+
+    mutex_lock(&dev->rpc_lock);
+    list_for_each_entry_safe(call, tmp, &dev->rpc_active, node) {
+        if (call->server == filp)
+            scull_rpc_finish(call, -EPIPE);
+    }
+    mutex_unlock(&dev->rpc_lock);
+}
+
+// Закрытие устройства: после этого /dev/scull_control может его удалить
+static void scull_put_dev(struct scull_buffer *dev)
+{
+    mutex_lock(&scull_devices_lock);
+    dev->users--;
+    mutex_unlock(&scull_devices_lock);
+}
+
 // Функция открытия устройства
 static int scull_open(struct inode *inode, struct file *filp)
 {
@@ -64,201 +1022,1433 @@ static int scull_open(struct inode *inode, struct file *filp)
     int minor = iminor(inode); // Получаем minor номер из inode
 
     // Проверяем, что minor номер в допустимом диапазоне
-    if (minor >= NUM_DEVICES) {
+    if (minor >= SCULL_MAX_DEVICES) {
         return -ENODEV; // Возвращаем ошибку "Устройство не найдено"
     }
 
-    // Получаем указатель на структуру устройства по minor номеру
-    dev = &devices[minor];
+    // Получаем указатель на структуру устройства по minor номеру.
+    // Пока устройство открыто, /dev/scull_control его не удалит
+    mutex_lock(&scull_devices_lock);
+    dev = devices[minor];
+    if (dev)
+        dev->users++;
+    mutex_unlock(&scull_devices_lock);
+    if (!dev)
+        return -ENODEV; // Устройство уже удалено
     // Сохраняем указатель в private_data для использования в других функциях
     filp->private_data = dev;
+    // Сообщаем io_uring, что IOCB_NOWAIT поддерживается
+    filp->f_mode |= FMODE_NOWAIT;
+
+    // В режиме BROADCAST писатель открывает устройство только O_WRONLY:
+    // курсор файла O_RDWR, который только пишет, никогда не сдвинется,
+    // и писатель ждал бы сам себя
+    if ((dev->mode & SCULL_MODE_BROADCAST) &&
+        (filp->f_mode & (FMODE_READ | FMODE_WRITE)) == (FMODE_READ | FMODE_WRITE)) {
+        scull_put_dev(dev);
+        return -EINVAL;
+    }
+
+    // В режиме BROADCAST каждый читатель получает свой курсор. Новый
+    // читатель начинает с самых старых данных, которые еще хранятся
+    if ((dev->mode & SCULL_MODE_BROADCAST) && (filp->f_mode & FMODE_READ)) {
+        struct scull_cursor *cursor = kzalloc(sizeof(*cursor), GFP_KERNEL);
+
+        if (!cursor) {
+            scull_put_dev(dev);
+            return -ENOMEM;
+        }
+        cursor->filp = filp;
+        spin_lock(&dev->cursor_lock);
+        cursor->pos = dev->ctrl->tail;
+        list_add_tail(&cursor->node, &dev->cursors);
+        spin_unlock(&dev->cursor_lock);
+    }
+
+    return 0; // Успешное завершение
+}
+
+// Функция закрытия устройства
+static int scull_release(struct inode *inode, struct file *filp)
+{
+    struct scull_buffer *dev = filp->private_data;
+
+    // Освобождаем место единственного читателя/писателя в режиме SPSC
+    cmpxchg(&dev->reader, filp, NULL);
+    cmpxchg(&dev->writer, filp, NULL);
+    // Клиенты этого сервера не должны ждать ответа вечно
+    scull_rpc_release(dev, filp);
+    // eventfd этого файла больше не сигналим
+    scull_efd_release(dev, filp);
+
+    // Удаляем курсор читателя: он мог быть самым медленным, и тогда
+    // у писателей освобождается место
+    if ((dev->mode & SCULL_MODE_BROADCAST) && (filp->f_mode & FMODE_READ)) {
+        struct scull_cursor *cursor;
+
+        spin_lock(&dev->cursor_lock);
+        cursor = scull_bcast_cursor(dev, filp);
+        if (cursor)
+            list_del(&cursor->node);
+        scull_bcast_update_tail(dev);
+        spin_unlock(&dev->cursor_lock);
+        kfree(cursor);
+        wake_up_interruptible_all(&dev->write_queue);
+    }
+
+    scull_put_dev(dev);
 
-    // Выводим информационное сообщение в журнал ядра
-    pr_info("scull_buffer: Device %d opened\n", minor);
     return 0; // Успешное завершение
 }
 
-// Функция закрытия устройства
-static int scull_release(struct inode *inode, struct file *filp)
+// Копирование len байт кольца, начиная со счетчика pos, в итератор
+// (один буфер read() или весь массив iovec readv()).
+// Копирование может быть в две части из-за кольцевой структуры:
+// 1. От индекса pos до конца буфера
+// 2. С начала буфера (если нужно)
+static int scull_ring_to_iter(char *buffer, u32 mask, struct iov_iter *to, u32 pos, u32 len)
+{
+    u32 index = pos & mask;
+    u32 first_part = min(len, mask + 1 - index);
+
+    if (copy_to_iter(buffer + index, first_part, to) != first_part)
+        return -EFAULT;
+    if (len > first_part &&
+        copy_to_iter(buffer, len - first_part, to) != len - first_part)
+        return -EFAULT;
+    return 0;
+}
+
+// Копирование len байт из итератора в кольцо по счетчику pos
+static int scull_ring_from_iter(char *buffer, u32 mask, struct iov_iter *from, u32 pos, u32 len)
+{
+    u32 index = pos & mask;
+    u32 first_part = min(len, mask + 1 - index);
+
+    if (copy_from_iter(buffer + index, first_part, from) != first_part)
+        return -EFAULT;
+    if (len > first_part &&
+        copy_from_iter(buffer, len - first_part, from) != len - first_part)
+        return -EFAULT;
+    return 0;
+}
+
+// То же самое для памяти ядра (заголовки записей)
+static void scull_ring_peek(char *buffer, u32 mask, void *dst, u32 pos, u32 len)
+{
+    u32 index = pos & mask;
+    u32 first_part = min(len, mask + 1 - index);
+
+    memcpy(dst, buffer + index, first_part);
+    memcpy(dst + first_part, buffer, len - first_part);
+}
+
+static void scull_ring_poke(char *buffer, u32 mask, const void *src, u32 pos, u32 len)
+{
+    u32 index = pos & mask;
+    u32 first_part = min(len, mask + 1 - index);
+
+    memcpy(buffer + index, src, first_part);
+    memcpy(buffer, src + first_part, len - first_part);
+}
+
+// Чтение в режиме записей. Обычно возвращается одна запись целиком
+// (только ее данные). В режиме SCULL_MODE_BATCH за один вызов отдается
+// столько целых записей, сколько помещается в count, вместе с их
+// заголовками - одним копированием подряд идущего участка кольца.
+// В *consumed возвращается, сколько байт кольца освобождено
+static ssize_t scull_read_frames(struct scull_buffer *dev, struct iov_iter *to,
+                                 u32 tail, u32 data_size, u32 *consumed)
+{
+    size_t count = iov_iter_count(to);
+    u32 span = 0; // Сколько байт кольца занимают отдаваемые записи
+    u32 len;      // Длина данных текущей записи
+
+    do {
+        // Хвост короче заголовка или заголовок, указывающий за пределы
+        // данных, - кольцо испорчено через mmap. Сначала проверяем, что
+        // заголовок помещается, и только потом вычитаем
+        if (data_size - span < SCULL_FRAME_HDR)
+            return -EIO;
+        scull_ring_peek(dev->buffer, dev->mask, &len, tail + span, SCULL_FRAME_HDR);
+        if (len > data_size - span - SCULL_FRAME_HDR)
+            return -EIO;
+
+        if (!(dev->mode & SCULL_MODE_BATCH)) {
+            // Запись не делится: если буфер мал, она остается в кольце
+            if (len > count)
+                return -EMSGSIZE;
+            if (scull_ring_to_iter(dev->buffer, dev->mask, to, tail + SCULL_FRAME_HDR, len))
+                return -EFAULT;
+            *consumed = SCULL_FRAME_HDR + len;
+            return len;
+        }
+
+        if (span + SCULL_FRAME_HDR + len > count)
+            break;
+        span += SCULL_FRAME_HDR + len;
+    } while (span < data_size);
+
+    if (!span)
+        return -EMSGSIZE; // Даже первая запись не помещается в буфер
+
+    if (scull_ring_to_iter(dev->buffer, dev->mask, to, tail, span))
+        return -EFAULT;
+    *consumed = span;
+    return span;
+}
+
+// Количество данных в шарде. head публикуется писателем шарда,
+// tail - читателем, оба читаем с acquire
+static inline u32 scull_shard_data(struct scull_shard *shard)
+{
+    return smp_load_acquire(&shard->head) - smp_load_acquire(&shard->tail);
+}
+
+// Общее количество данных во всех шардах
+static u32 scull_mq_data_size(struct scull_buffer *dev)
+{
+    u32 data_size = 0;
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_shards; i++)
+        data_size += scull_shard_data(&dev->shards[i]);
+    return data_size;
+}
+
+// Шард, из которого читать следующую запись, и ее заголовок.
+// По кругу - первый непустой шард после прочитанного в прошлый раз.
+// В режиме ORDERED - шард, в начале которого лежит запись с номером
+// mq_next_seq. Если ее писатель еще не опубликовал запись, читать
+// нечего, даже если в других шардах есть записи с большими номерами
+static struct scull_shard *scull_mq_next(struct scull_buffer *dev, struct scull_mq_hdr *hdr)
+{
+    struct scull_shard *shard;
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_shards; i++) {
+        shard = &dev->shards[(dev->mq_rr + i) % dev->nr_shards];
+        if (!scull_shard_data(shard))
+            continue;
+        scull_ring_peek(shard->buffer, dev->shard_mask, hdr, shard->tail, sizeof(*hdr));
+        if (!(dev->mode & SCULL_MODE_ORDERED) || hdr->seq == dev->mq_next_seq)
+            return shard;
+    }
+    return NULL;
+}
+
+// Шард, в который пишет текущий CPU
+static inline struct scull_shard *scull_mq_this_shard(struct scull_buffer *dev)
+{
+    return &dev->shards[raw_smp_processor_id() % dev->nr_shards];
+}
+
+// Чтение в режиме MQ. Отдается одна запись (только данные), а в режиме
+// BATCH - столько целых записей, сколько помещается, каждая с длиной (u32)
+// впереди - тот же формат, что и у FRAMED с BATCH
+static ssize_t scull_mq_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_buffer *dev = filp->private_data;
+    size_t count = iov_iter_count(to);
+    bool nowait = scull_nowait(iocb);
+    struct scull_shard *shard;
+    struct scull_mq_hdr hdr;
+    ssize_t retval = 0;
+    bool wake_next;
+    u64 slept, hold;
+    int locked, err;
+
+    locked = scull_side_lock(dev, filp, &dev->read_lock, &dev->reader, &dev->reader_busy, nowait);
+    if (locked < 0)
+        return locked;
+
+    // Ждем, пока появится запись, которую можно отдать
+    while (!(shard = scull_mq_next(dev, &hdr))) {
+        scull_side_unlock(&dev->read_lock, &dev->reader_busy, locked);
+
+        if (nowait)
+            return -EAGAIN;
+
+        if (!scull_busy_poll(dev, scull_mq_next(dev, &hdr))) {
+            slept = scull_account_sleep(dev, false);
+            err = wait_event_interruptible_exclusive(dev->read_queue, scull_mq_next(dev, &hdr));
+            scull_account_wakeup(dev, false, slept);
+            if (err)
+                return -ERESTARTSYS;
+        }
+
+        locked = scull_side_lock(dev, filp, &dev->read_lock, &dev->reader, &dev->reader_busy, nowait);
+        if (locked < 0)
+            return locked;
+    }
+
+    hold = ktime_get_ns();
+    do {
+        if (!(dev->mode & SCULL_MODE_BATCH)) {
+            // Запись не делится: если буфер мал, она остается в шарде
+            if (hdr.len > count) {
+                retval = -EMSGSIZE;
+                break;
+            }
+            if (scull_ring_to_iter(shard->buffer, dev->shard_mask, to,
+                                   shard->tail + sizeof(hdr), hdr.len)) {
+                retval = -EFAULT;
+                break;
+            }
+            retval = hdr.len;
+        } else {
+            if (retval + SCULL_FRAME_HDR + hdr.len > count) {
+                if (!retval)
+                    retval = -EMSGSIZE; // Даже первая запись не помещается
+                break;
+            }
+            if (copy_to_iter(&hdr.len, SCULL_FRAME_HDR, to) != SCULL_FRAME_HDR ||
+                scull_ring_to_iter(shard->buffer, dev->shard_mask, to,
+                                   shard->tail + sizeof(hdr), hdr.len)) {
+                if (!retval)
+                    retval = -EFAULT;
+                break;
+            }
+            retval += SCULL_FRAME_HDR + hdr.len;
+        }
+
+        // Освобождаем место в шарде только после копирования
+        smp_store_release(&shard->tail, shard->tail + sizeof(hdr) + hdr.len);
+        dev->mq_next_seq++;
+        dev->mq_rr = (shard - dev->shards + 1) % dev->nr_shards;
+    } while ((dev->mode & SCULL_MODE_BATCH) && (shard = scull_mq_next(dev, &hdr)));
+
+    // В шардах появилось место - будим писателей
+    if (retval > 0) {
+        scull_account_read(dev, retval, scull_mq_data_size(dev));
+        scull_wake(&dev->write_queue);
+    }
+    // Остались записи - их заберет следующий спящий читатель
+    wake_next = scull_mq_next(dev, &hdr);
+
+    if (locked)
+        scull_account_hold(dev, false, hold);
+    scull_side_unlock(&dev->read_lock, &dev->reader_busy, locked);
+    if (wake_next)
+        scull_wake(&dev->read_queue);
+    return retval;
+}
+
+// Запись в режиме MQ: каждый write() - одна запись в шарде текущего CPU.
+// Писатели разных CPU берут разные мьютексы и не мешают друг другу.
+// Номер записи (ORDERED) выдается после копирования данных, прямо перед
+// публикацией: выданный номер всегда будет опубликован, и читатель,
+// ждущий его, не зависнет из-за ошибки копирования
+static ssize_t scull_mq_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_buffer *dev = filp->private_data;
+    size_t count = iov_iter_count(from);
+    bool nowait = scull_nowait(iocb);
+    u32 need = sizeof(struct scull_mq_hdr) + count; // Место под запись целиком
+    struct scull_shard *shard;
+    struct scull_mq_hdr hdr;
+    ssize_t retval;
+    u64 slept, hold;
+    u32 head;
+    int err;
+
+    // Пустая запись неотличима от конца файла - не пишем ее
+    if (!count)
+        return 0;
+    // Запись, которая не поместится даже в пустой шард
+    if (count > dev->shard_size - sizeof(hdr))
+        return -EMSGSIZE;
+
+    for (;;) {
+        // Шард выбирается заново после каждого сна: процесс мог сменить CPU
+        shard = scull_mq_this_shard(dev);
+        if (nowait) {
+            if (!mutex_trylock(&shard->lock))
+                return -EAGAIN;
+        } else if (mutex_lock_interruptible(&shard->lock)) {
+            return -ERESTARTSYS;
+        }
+
+        if (dev->shard_size - scull_shard_data(shard) >= need)
+            break;
+        mutex_unlock(&shard->lock);
+
+        if (nowait)
+            return -EAGAIN;
+
+        slept = scull_account_sleep(dev, true);
+        err = wait_event_interruptible(dev->write_queue,
+            dev->shard_size - scull_shard_data(shard) >= need);
+        scull_account_wakeup(dev, true, slept);
+        if (err)
+            return -ERESTARTSYS;
+    }
+
+    hold = ktime_get_ns();
+    head = shard->head;
+    if (scull_ring_from_iter(shard->buffer, dev->shard_mask, from, head + sizeof(hdr), count)) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    hdr.len = count;
+    hdr.seq = (dev->mode & SCULL_MODE_ORDERED) ? atomic_inc_return(&dev->mq_seq) : 0;
+    scull_ring_poke(shard->buffer, dev->shard_mask, &hdr, head, sizeof(hdr));
+
+    // Публикуем запись: читатель увидит ее только целиком
+    smp_store_release(&shard->head, head + need);
+    retval = count;
+
+out:
+    scull_account_hold(dev, true, hold);
+    mutex_unlock(&shard->lock);
+    if (retval > 0) {
+        // Заполнение в режиме MQ - сумма по всем шардам
+        u32 data_size = scull_mq_data_size(dev);
+
+        scull_account_write(dev, retval, data_size);
+        scull_efd_edge(dev, SCULL_EFD_DATA, data_size, retval);
+        scull_wake(&dev->read_queue);
+    }
+    return retval;
+}
+
+// Есть ли что читать у читателя режима BROADCAST (или он отключен).
+// Курсор живет, пока открыт файл, поэтому его можно читать без блокировки:
+// pos меняет только сам этот читатель
+static inline bool scull_bcast_ready(struct scull_buffer *dev, struct scull_cursor *cursor)
+{
+    return READ_ONCE(cursor->dropped) ||
+           smp_load_acquire(&dev->ctrl->head) - READ_ONCE(cursor->pos) >= scull_read_lowat(dev);
+}
+
+// Чтение в режиме BROADCAST. Каждый читатель двигает только свой курсор,
+// поэтому читатели не берут read_lock и копируют данные параллельно.
+// Писатель не трогает байты между tail и head, а tail не обгоняет ни
+// одного подключенного читателя. Если писатель отключил читателя во
+// время копирования, данные могли быть перезаписаны - тогда -EPIPE
+static ssize_t scull_bcast_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_buffer *dev = filp->private_data;
+    bool nowait = scull_nowait(iocb);
+    struct scull_cursor *cursor;
+    u32 data_size, pos, len, tail, freed;
+    u64 slept;
+    int err;
+
+    spin_lock(&dev->cursor_lock);
+    cursor = scull_bcast_cursor(dev, filp);
+    spin_unlock(&dev->cursor_lock);
+    if (!cursor)
+        return -EBADF;
+
+    while (!scull_bcast_ready(dev, cursor)) {
+        if (nowait)
+            return -EAGAIN;
+
+        if (scull_busy_poll(dev, scull_bcast_ready(dev, cursor)))
+            break;
+
+        slept = scull_account_sleep(dev, false);
+        err = wait_event_interruptible(dev->read_queue, scull_bcast_ready(dev, cursor));
+        scull_account_wakeup(dev, false, slept);
+        if (err)
+            return -ERESTARTSYS;
+    }
+
+    if (READ_ONCE(cursor->dropped))
+        return -EPIPE; // Читатель отстал и отключен, нужно открыть устройство заново
+
+    pos = cursor->pos;
+    data_size = smp_load_acquire(&dev->ctrl->head) - pos;
+    len = min_t(size_t, iov_iter_count(to), data_size);
+
+    if (scull_ring_to_iter(dev->buffer, dev->mask, to, pos, len))
+        return -EFAULT;
+
+    // Сдвигаем курсор и, если мы были самыми медленными, tail
+    spin_lock(&dev->cursor_lock);
+    if (cursor->dropped) {
+        spin_unlock(&dev->cursor_lock);
+        return -EPIPE;
+    }
+    WRITE_ONCE(cursor->pos, pos + len);
+    tail = dev->ctrl->tail;
+    scull_bcast_update_tail(dev);
+    freed = dev->ctrl->tail - tail;
+    spin_unlock(&dev->cursor_lock);
+
+    // Заполнение для читателя BROADCAST - сколько осталось прочитать ему
+    scull_account_read(dev, len, data_size - len);
+    // Место освобождается, только если мы были самыми медленными
+    if (freed)
+        scull_efd_edge(dev, SCULL_EFD_SPACE, scull_space_available(dev), freed);
+
+    if (scull_space_available(dev) >= scull_write_lowat(dev))
+        scull_wake(&dev->write_queue);
+    return len;
+}
+
+// Режим OVERWRITE: освобождаем need байт, сдвигая tail вперед.
+// В режиме FRAMED отбрасываются только целые записи - читатель никогда
+// не получит обрывок. tail меняется через cmpxchg, потому что его
+// одновременно двигают читатели. Вызывается под write_lock, так что
+// head и заголовки записей меняет только этот писатель
+static void scull_overwrite_make_room(struct scull_buffer *dev, u32 need)
 {
-    // Просто сообщаем о закрытии устройства
-    pr_info("scull_buffer: Device %d closed\n", iminor(inode));
-    return 0; // Успешное завершение
+    u32 head = dev->ctrl->head;
+    u32 tail, space, drop, records;
+    u32 len;
+
+    for (;;) {
+        tail = smp_load_acquire(&dev->ctrl->tail);
+        space = dev->size - (head - tail);
+        if (space >= need)
+            return;
+
+        drop = need - space;
+        records = 0;
+        if (dev->mode & SCULL_MODE_FRAMED) {
+            // Округляем вверх до границы записи. Заголовки мог записать
+            // процесс через mmap, поэтому обход ограничен данными кольца
+            u32 used = head - tail;
+            u32 bytes = 0;
+
+            while (bytes < drop && bytes < used) {
+                if (used - bytes < SCULL_FRAME_HDR)
+                    break;
+                scull_ring_peek(dev->buffer, dev->mask, &len, tail + bytes, SCULL_FRAME_HDR);
+                if (len > used - bytes - SCULL_FRAME_HDR)
+                    break;
+                bytes += SCULL_FRAME_HDR + len;
+                records++;
+            }
+            // Испорченный заголовок: границ записей больше не найти,
+            // выбрасываем все кольцо
+            if (bytes < drop)
+                bytes = used;
+            drop = bytes;
+        }
+
+        if (cmpxchg(&dev->ctrl->tail, tail, tail + drop) == tail) {
+            atomic64_add(drop, &dev->lost_bytes);
+            atomic64_add(records, &dev->lost_records);
+            return;
+        }
+        // Читатель успел сдвинуть tail - пересчитываем
+    }
 }
 
-// Функция чтения из устройства
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+// Функция чтения из устройства. Весь массив iovec (readv, io_uring)
+// копируется за один захват мьютекса и с одним пробуждением писателей
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct file *filp = iocb->ki_filp;
     struct scull_buffer *dev = filp->private_data; // Получаем наше устройство
+    size_t count = iov_iter_count(to); // Сколько байт запрошено всего
+    bool nowait = scull_nowait(iocb);  // Запрещено ли блокироваться
     ssize_t retval = 0;          // Возвращаемое значение (количество прочитанных байт)
-    int bytes_to_read;           // Сколько байт будем читать в этой операции
-    int bytes_read_first_part;   // Сколько байт прочитаем из первой части буфера
-
-    // Захватываем мьютекс. Если получен сигнал, возвращаем ошибку
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS; // Процесс был прерван сигналом
-
-    // Ждем, пока в буфере появятся данные для чтения
-    while (dev->data_size == 0) {
+    u32 data_size;               // Количество данных в буфере
+    u32 tail;                    // Счетчик прочитанных байт
+    u32 consumed;                // Сколько байт кольца освободилось
+    u64 slept, hold;             // Начало сна и начало копирования под мьютексом (нс)
+    int locked;                  // Захвачен ли мьютекс читателей
+    int err;                     // Результат ожидания
+
+    // Режимы MQ и BROADCAST задаются при загрузке, поэтому проверка без блокировки
+    if (dev->mode & SCULL_MODE_MQ)
+        return scull_mq_read_iter(iocb, to);
+    if (dev->mode & SCULL_MODE_BROADCAST)
+        return scull_bcast_read_iter(iocb, to);
+
+    // Захватываем мьютекс читателей (в режиме SPSC - проверка владельца и бита busy)
+    locked = scull_side_lock(dev, filp, &dev->read_lock, &dev->reader, &dev->reader_busy, nowait);
+    if (locked < 0)
+        return locked;
+
+    // Ждем, пока в буфере наберется хотя бы read_wm байт
+    while ((data_size = scull_data_size(dev)) < scull_read_lowat(dev)) {
         // Временно отпускаем мьютекс перед ожиданием
-        mutex_unlock(&dev->lock);
+        scull_side_unlock(&dev->read_lock, &dev->reader_busy, locked);
 
-        // Проверяем, открыто ли устройство в неблокирующем режиме
-        if (filp->f_flags & O_NONBLOCK)
+        // Проверяем, можно ли блокироваться (O_NONBLOCK или IOCB_NOWAIT)
+        if (nowait)
             return -EAGAIN; // Возвращаем ошибку "Попробуйте снова"
 
-        // Сообщаем, что процесс идет спать из-за пустого буфера
-        pr_info("scull_buffer: Buffer empty, process %d (%s) going to sleep\n",
-                current->pid, current->comm);
-
-        // Усыпляем процесс в очереди чтения. Проснется когда data_size > 0
-        // wait_event_interruptible проверяет условие после пробуждения
-        if (wait_event_interruptible(dev->read_queue, (dev->data_size > 0)))
-            return -ERESTARTSYS; // Было прерывание (например, Ctrl+C)
+        // В режиме busy-poll сначала крутимся, уходим спать только
+        // если за бюджет данных так и не стало
+        if (!scull_busy_poll(dev, scull_data_size(dev) >= scull_read_lowat(dev))) {
+            // Отмечаем, что процесс идет спать из-за пустого буфера
+            slept = scull_account_sleep(dev, false);
+
+            // Усыпляем процесс в очереди чтения. Проснется когда данных >= read_wm.
+            // Условие проверяется после пробуждения; сон эксклюзивный,
+            // см. scull_wake
+            err = wait_event_interruptible_exclusive(dev->read_queue,
+                (scull_data_size(dev) >= scull_read_lowat(dev)));
+            scull_account_wakeup(dev, false, slept);
+            if (err)
+                return -ERESTARTSYS; // Было прерывание (например, Ctrl+C)
+        }
 
         // Проснулись, снова пытаемся захватить мьютекс
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
+        locked = scull_side_lock(dev, filp, &dev->read_lock, &dev->reader, &dev->reader_busy, nowait);
+        if (locked < 0)
+            return locked;
     }
 
-    // Определяем, сколько байт можем прочитать (минимум из запрошенного и доступного)
-    bytes_to_read = min(count, (size_t)dev->data_size);
+    hold = ktime_get_ns();
+retry:
+    // tail читаем заново: в режиме OVERWRITE его двигает и писатель
+    tail = smp_load_acquire(&dev->ctrl->tail);
+    data_size = smp_load_acquire(&dev->ctrl->head) - tail;
 
-    // Чтение может быть в две части из-за кольцевой структуры:
-    // 1. От read_index до конца буфера
-    // 2. С начала буфера (если нужно)
-    bytes_read_first_part = min(bytes_to_read, BUFFER_SIZE - dev->read_index);
-
-    // Копируем данные из ядра в пользовательское пространство (первая часть)
-    if (copy_to_user(buf, dev->buffer + dev->read_index, bytes_read_first_part)) {
-        retval = -EFAULT; // Ошибка копирования
-        goto out; // Переходим к метке выхода
+    // Процесс с mmap мог испортить счетчики - не выходим за пределы буфера
+    if (data_size > dev->size) {
+        retval = -EIO;
+        goto out;
     }
 
-    // Копируем данные из ядра в пользовательское пространство (вторая часть, если есть)
-    if (bytes_to_read > bytes_read_first_part) {
-        if (copy_to_user(buf + bytes_read_first_part, dev->buffer, 
-                        bytes_to_read - bytes_read_first_part)) {
+    if (dev->mode & SCULL_MODE_FRAMED) {
+        // Режим записей: читаем только целые записи
+        retval = scull_read_frames(dev, to, tail, data_size, &consumed);
+        // Заголовок мог быть затерт писателем прямо во время разбора
+        if ((retval == -EIO || retval == -EMSGSIZE) &&
+            (dev->mode & SCULL_MODE_OVERWRITE) && READ_ONCE(dev->ctrl->tail) != tail)
+            goto retry;
+        if (retval < 0)
+            goto out;
+    } else {
+        // Определяем, сколько байт можем прочитать (минимум из запрошенного и доступного)
+        consumed = min(count, (size_t)data_size);
+
+        // Копируем данные из ядра в пользовательское пространство
+        if (scull_ring_to_iter(dev->buffer, dev->mask, to, tail, consumed)) {
             retval = -EFAULT; // Ошибка копирования
             goto out; // Переходим к метке выхода
         }
+        retval = consumed;
     }
 
-    // Обновляем индекс чтения с учетом кольцевой структуры
-    dev->read_index = (dev->read_index + bytes_to_read) % BUFFER_SIZE;
-    // Уменьшаем количество данных в буфере
-    dev->data_size -= bytes_to_read;
-    // Устанавливаем возвращаемое значение
-    retval = bytes_to_read;
+    if (dev->mode & SCULL_MODE_OVERWRITE) {
+        // Писатель мог затереть то, что мы копировали, и сдвинуть tail.
+        // Тогда скопированное недостоверно: откатываем итератор и читаем
+        // заново с нового tail
+        if (cmpxchg(&dev->ctrl->tail, tail, tail + consumed) != tail) {
+            iov_iter_revert(to, retval);
+            goto retry;
+        }
+    } else {
+        // Публикуем новый tail: место освобождается только после копирования
+        smp_store_release(&dev->ctrl->tail, tail + consumed);
+    }
 
-    // Информационное сообщение о успешном чтении
-    pr_info("scull_buffer: Read %zu bytes from device %d. Data size: %d\n",
-            retval, iminor(filp->f_path.dentry->d_inode), dev->data_size);
+    // Учитываем чтение в статистике (без вывода текста в журнал)
+    scull_account_read(dev, retval, data_size - consumed);
+    scull_efd_edge(dev, SCULL_EFD_SPACE, dev->size - (data_size - consumed), consumed);
 
-    // После чтения в буфере точно появилось свободное место
-    // Будим все процессы, ждущие в очереди записи
-    wake_up_interruptible(&dev->write_queue);
+    // После чтения в буфере появилось свободное место. Писателей будим,
+    // только когда свободно не меньше write_wm: пробуждения идут пачками
+    if (dev->size - (data_size - consumed) >= scull_write_lowat(dev))
+        scull_wake(&dev->write_queue);
 
 // Метка выхода из функции
 out:
+    if (locked)
+        scull_account_hold(dev, false, hold);
     // Всегда отпускаем мьютекс перед выходом
-    mutex_unlock(&dev->lock);
+    scull_side_unlock(&dev->read_lock, &dev->reader_busy, locked);
+    // Данных хватит и следующему читателю - передаем пробуждение дальше
+    // (и после ошибки тоже: наше пробуждение не должно пропасть).
+    // Будим без мьютекса, чтобы он не уснул снова на нем
+    if (scull_data_size(dev) >= scull_read_lowat(dev))
+        scull_wake(&dev->read_queue);
     return retval; // Возвращаем результат операции
 }
 
-// Функция записи в устройство
-static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+// Перенос кольца на узел NUMA текущего процесса (первого писателя) -
+// та же замена буфера, что и при смене емкости. Если заменить буфер
+// нельзя (SPSC, BROADCAST, активный mmap), кольцо остается где было
+static void scull_numa_settle(struct scull_buffer *dev)
+{
+    int node = numa_node_id();
+
+    WRITE_ONCE(dev->numa_node, node);
+    if (scull_resize_ring(dev, READ_ONCE(dev->size)))
+        WRITE_ONCE(dev->numa_node, NUMA_NO_NODE);
+    else
+        pr_info("scull_buffer: Device %d moved to NUMA node %d\n", MINOR(dev->devno), node);
+}
+
+// Функция записи в устройство. Весь массив iovec (writev, io_uring)
+// ложится в кольцо за один захват мьютекса и с одним пробуждением читателей.
+// В режиме записей весь массив iovec образует одну запись
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+    struct file *filp = iocb->ki_filp;
     struct scull_buffer *dev = filp->private_data; // Получаем наше устройство
+    size_t count = iov_iter_count(from); // Сколько байт передано всего
+    bool nowait = scull_nowait(iocb);    // Запрещено ли блокироваться
     ssize_t retval = 0;          // Возвращаемое значение (количество записанных байт)
-    int space_available;         // Свободное место в буфере
-    int bytes_to_write;          // Сколько байт будем записывать в этой операции
-    int bytes_write_first_part;  // Сколько байт запишем в первую часть буфера
-
-    // Захватываем мьютекс. Если получен сигнал, возвращаем ошибку
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS; // Процесс был прерван сигналом
+    u32 space_available;         // Свободное место в буфере
+    u32 data_size;               // Количество данных в буфере после записи
+    u32 lowat;                   // Сколько места нужно, чтобы начать запись
+    u32 head;                    // Счетчик записанных байт
+    u32 len;                     // Длина записи (в режиме записей)
+    u32 bytes_to_write;          // Сколько байт кольца займет эта операция
+    u64 slept, hold;             // Начало сна и начало копирования под мьютексом (нс)
+    int locked;                  // Захвачен ли мьютекс писателей
+    int err;                     // Результат ожидания
+
+    // Режим MQ задается при загрузке, поэтому проверка без блокировки
+    if (dev->mode & SCULL_MODE_MQ)
+        return scull_mq_write_iter(iocb, from);
+
+    // Первая запись в кольцо с узлом "первого писателя": переносим
+    // кольцо на узел этого процесса. Проверка - одно чтение на операцию.
+    // Перенос берет все мьютексы и копирует кольцо, поэтому неблокирующий
+    // писатель его не делает: переедет кольцо при первой блокирующей записи
+    if (unlikely(READ_ONCE(dev->numa_auto)) && !nowait && xchg(&dev->numa_auto, false))
+        scull_numa_settle(dev);
+
+    if (dev->mode & SCULL_MODE_FRAMED) {
+        // Пустая запись неотличима от конца файла - не пишем ее
+        if (!count)
+            return 0;
+        // Запись, которая не поместится даже в пустое кольцо
+        if (scull_frame_too_big(dev, count))
+            return -EMSGSIZE;
+    }
 
-    // Вычисляем свободное место в буфере
-    space_available = BUFFER_SIZE - dev->data_size;
+    // Захватываем мьютекс писателей (в режиме SPSC - проверка владельца и бита busy)
+    locked = scull_side_lock(dev, filp, &dev->write_lock, &dev->writer, &dev->writer_busy, nowait);
+    if (locked < 0)
+        return locked;
+
+    // В режиме OVERWRITE писатель никогда не ждет читателя: место под
+    // все сообщение освобождается за счет самых старых данных
+    if (dev->mode & SCULL_MODE_OVERWRITE)
+        scull_overwrite_make_room(dev, (dev->mode & SCULL_MODE_FRAMED) ?
+                                  count + SCULL_FRAME_HDR : min_t(size_t, count, dev->size));
+
+    // Ждем, пока свободного места хватит на все сообщение или хотя бы
+    // на write_wm байт. Место пересчитывается под мьютексом: пока мы
+    // спали, его могли занять другие писатели или уменьшить изменение емкости
+    while ((space_available = scull_space_available(dev)) <
+           (lowat = scull_write_need(dev, count))) {
+        // Емкость уменьшили, пока мы спали: места под запись не будет
+        // никогда. -EMSGSIZE вернет проверка после цикла
+        if (scull_frame_too_big(dev, count))
+            break;
+
+        // В режиме DROP_SLOW писатель не ждет, а отключает отстающих читателей
+        if ((dev->mode & SCULL_MODE_DROP_SLOW) && scull_bcast_drop_slow(dev, lowat))
+            continue;
 
-    // Ждем, пока в буфере появится свободное место для записи
-    while (space_available == 0) {
         // Временно отпускаем мьютекс перед ожиданием
-        mutex_unlock(&dev->lock);
+        scull_side_unlock(&dev->write_lock, &dev->writer_busy, locked);
 
-        // Проверяем, открыто ли устройство в неблокирующем режиме
-        if (filp->f_flags & O_NONBLOCK)
+        // Проверяем, можно ли блокироваться (O_NONBLOCK или IOCB_NOWAIT)
+        if (nowait)
             return -EAGAIN; // Возвращаем ошибку "Попробуйте снова"
-        // Сообщаем, что процесс идет спать из-за полного буфера
-        pr_info("scull_buffer: Buffer full, process %d (%s) going to sleep\n",
-                current->pid, current->comm);
+        // Отмечаем, что процесс идет спать из-за полного буфера
+        slept = scull_account_sleep(dev, true);
 
         // Усыпляем процесс в очереди записи. Проснется когда появится место
-        // Вычисляем space_available снова после пробуждения
-        if (wait_event_interruptible(dev->write_queue, 
-            (space_available = (BUFFER_SIZE - dev->data_size)) > 0))
+        // В побайтовом кольце любой писатель может начать, как только
+        // свободно write_wm байт, поэтому сон эксклюзивный. В режиме
+        // FRAMED писателю нужно место под всю запись, и разбуженный
+        // мог бы не поместиться, не передав пробуждение, - там будим всех
+        if (dev->mode & SCULL_MODE_FRAMED)
+            err = wait_event_interruptible(dev->write_queue,
+                                           scull_space_available(dev) >= lowat ||
+                                           scull_frame_too_big(dev, count));
+        else
+            err = wait_event_interruptible_exclusive(dev->write_queue,
+                                                     scull_space_available(dev) >= lowat);
+        scull_account_wakeup(dev, true, slept);
+        if (err)
             return -ERESTARTSYS; // Было прерывание
 
         // Проснулись, снова пытаемся захватить мьютекс
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
+        locked = scull_side_lock(dev, filp, &dev->write_lock, &dev->writer, &dev->writer_busy, nowait);
+        if (locked < 0)
+            return locked;
     }
 
-    // Определяем, сколько байт можем записать (минимум из запрошенного и доступного)
-    bytes_to_write = min(count, (size_t)space_available);
+    hold = ktime_get_ns();
 
-    // Запись может быть в две части из-за кольцевой структуры:
-    // 1. От write_index до конца буфера
-    // 2. С начала буфера (если нужно)
-    bytes_write_first_part = min(bytes_to_write, BUFFER_SIZE - dev->write_index);
-
-    // Копируем данные из пользовательского пространства в ядро (первая часть)
-    if (copy_from_user(dev->buffer + dev->write_index, buf, bytes_write_first_part)) {
-        retval = -EFAULT; // Ошибка копирования
-        goto out; // Переходим к метке выхода
+    // Процесс с mmap мог испортить счетчики - не выходим за пределы буфера
+    if (space_available > dev->size) {
+        retval = -EIO;
+        goto out;
     }
 
-    // Копируем данные из пользовательского пространства в ядро (вторая часть, если есть)
-    if (bytes_to_write > bytes_write_first_part) {
-        if (copy_from_user(dev->buffer, buf + bytes_write_first_part, 
-                          bytes_to_write - bytes_write_first_part)) {
+    head = dev->ctrl->head;
+
+    if (dev->mode & SCULL_MODE_FRAMED) {
+        // Режим или емкость могли поменяться, пока мы спали
+        if (!count || count > dev->size - SCULL_FRAME_HDR) {
+            retval = count ? -EMSGSIZE : 0;
+            goto out;
+        }
+        // Заголовок с длиной, затем данные записи. Место под запись
+        // целиком уже есть: так гарантирует scull_write_need
+        len = count;
+        scull_ring_poke(dev->buffer, dev->mask, &len, head, SCULL_FRAME_HDR);
+        if (scull_ring_from_iter(dev->buffer, dev->mask, from, head + SCULL_FRAME_HDR, len)) {
+            retval = -EFAULT; // Ошибка копирования
+            goto out; // Переходим к метке выхода
+        }
+        bytes_to_write = SCULL_FRAME_HDR + len;
+        retval = len;
+    } else {
+        // Определяем, сколько байт можем записать (минимум из запрошенного и доступного)
+        bytes_to_write = min(count, (size_t)space_available);
+
+        // Копируем данные из пользовательского пространства в ядро
+        if (scull_ring_from_iter(dev->buffer, dev->mask, from, head, bytes_to_write)) {
             retval = -EFAULT; // Ошибка копирования
             goto out; // Переходим к метке выхода
         }
+        retval = bytes_to_write;
     }
 
-    // Обновляем индекс записи с учетом кольцевой структуры
-    dev->write_index = (dev->write_index + bytes_to_write) % BUFFER_SIZE;
-    // Увеличиваем количество данных в буфере
-    dev->data_size += bytes_to_write;
-    // Устанавливаем возвращаемое значение
-    retval = bytes_to_write;
+    // Публикуем новый head: читатель увидит данные только после копирования
+    smp_store_release(&dev->ctrl->head, head + bytes_to_write);
 
-    // Информационное сообщение о успешной записи
-    pr_info("scull_buffer: Wrote %zu bytes to device %d. Data size: %d\n",
-            retval, iminor(filp->f_path.dentry->d_inode), dev->data_size);
+    // Учитываем запись в статистике (без вывода текста в журнал)
+    data_size = scull_data_size(dev);
+    scull_account_write(dev, retval, data_size);
+    scull_efd_edge(dev, SCULL_EFD_DATA, data_size, bytes_to_write);
 
-    // После записи в буфере точно появились новые данные
-    // Будим все процессы, ждущие в очереди чтения
-    wake_up_interruptible(&dev->read_queue);
+    // После записи в буфере появились новые данные. Читателей будим,
+    // только когда набралось не меньше read_wm байт
+    if (data_size >= scull_read_lowat(dev))
+        scull_wake(&dev->read_queue);
 
 // Метка выхода из функции
 out:
+    if (locked)
+        scull_account_hold(dev, true, hold);
     // Всегда отпускаем мьютекс перед выходом
-    mutex_unlock(&dev->lock);
+    scull_side_unlock(&dev->write_lock, &dev->writer_busy, locked);
+    // Места хватит и следующему писателю - передаем пробуждение дальше
+    if (!(dev->mode & SCULL_MODE_FRAMED) && scull_space_available(dev) >= scull_write_lowat(dev))
+        scull_wake(&dev->write_queue);
     return retval; // Возвращаем результат операции
 }
 
+// Смена режима (FRAMED, BATCH, OVERWRITE). При смене FRAMED устройство
+// должно быть пустым: иначе байты, записанные в одном режиме, были бы
+// прочитаны в другом
+static int scull_set_mode(struct scull_buffer *dev, unsigned long mode)
+{
+    int retval = 0;
+
+    // SPSC, MQ и BROADCAST задаются только при загрузке
+    if (mode & ~(SCULL_MODE_FRAMED | SCULL_MODE_BATCH | SCULL_MODE_OVERWRITE))
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    // В режиме MQ записи есть всегда, меняется только BATCH - он
+    // касается одних читателей, и данные в шардах не мешают
+    if (dev->mode & SCULL_MODE_MQ) {
+        if (mode & ~SCULL_MODE_BATCH) {
+            retval = -EINVAL;
+            goto out;
+        }
+        mutex_lock(&dev->read_lock);
+        write_seqcount_begin(&dev->cfg_seq);
+        dev->mode = (dev->mode & ~SCULL_MODE_BATCH) | mode;
+        write_seqcount_end(&dev->cfg_seq);
+        mutex_unlock(&dev->read_lock);
+        goto out;
+    }
+
+    // BATCH имеет смысл только с FRAMED
+    if (mode & SCULL_MODE_BATCH && !(mode & SCULL_MODE_FRAMED)) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    // В режиме SPSC операции идут без мьютексов - их не остановить,
+    // а читатели режима BROADCAST не берут read_lock
+    if (dev->mode & (SCULL_MODE_SPSC | SCULL_MODE_BROADCAST)) {
+        retval = -EBUSY;
+        goto out;
+    }
+
+    // Формат данных меняется только вместе с FRAMED - тогда буфер должен
+    // быть пуст. OVERWRITE и BATCH можно переключать на ходу
+    mutex_lock(&dev->read_lock);
+    mutex_lock(&dev->write_lock);
+    if (((dev->mode ^ mode) & SCULL_MODE_FRAMED) && scull_data_size(dev)) {
+        retval = -EBUSY;
+    } else {
+        write_seqcount_begin(&dev->cfg_seq);
+        dev->mode = mode;
+        write_seqcount_end(&dev->cfg_seq);
+    }
+    mutex_unlock(&dev->write_lock);
+    mutex_unlock(&dev->read_lock);
+
+out:
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+// Приведение запрошенной емкости к степени двойки в допустимых границах
+static u32 scull_ring_size(unsigned long size)
+{
+    if (!size)
+        return SCULL_DEFAULT_SIZE;
+    size = clamp_t(unsigned long, size, SCULL_MIN_SIZE, SCULL_MAX_SIZE);
+    return roundup_pow_of_two(size);
+}
+
+// Память под данные кольца (или шарда) на узле node. Большие страницы
+// берутся, только если кольцо не меньше одной большой страницы.
+// vmalloc_huge не принимает узел и берет память на узле текущего CPU,
+// поэтому он годится, только если узел любой или совпадает с текущим
+// (при SCULL_NUMA_AUTO это узел первого писателя). Иначе явный узел
+// не был бы соблюден - тогда обычные страницы через vzalloc_node
+static void *scull_vzalloc(struct scull_buffer *dev, u32 size, int node)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    if (dev->huge && size >= PMD_SIZE &&
+        (node == NUMA_NO_NODE || node == numa_node_id()))
+        return vmalloc_huge(size, GFP_KERNEL | __GFP_ZERO);
+#endif
+    return vzalloc_node(size, node);
+}
+
+// Выделение памяти кольца: управляющая страница и страницы данных.
+// Буфер берется из vmalloc (массив отдельных страниц), поэтому кольца
+// в сотни мегабайт не требуют непрерывной физической памяти, а страницы
+// можно отдать в mmap. Память обнуляется, чтобы через mmap не утекло
+// старое содержимое ядра
+static int scull_alloc_ring(struct scull_buffer *dev, u32 size)
+{
+    struct page *page;
+
+    // Управляющую страницу читают обе стороны на каждой операции -
+    // она на том же узле, что и данные
+    page = alloc_pages_node(dev->numa_node, GFP_KERNEL | __GFP_ZERO, 0);
+    if (!page)
+        return -ENOMEM;
+    dev->ctrl = page_address(page);
+
+    dev->buffer = scull_vzalloc(dev, size, dev->numa_node);
+    if (!dev->buffer) {
+        free_page((unsigned long)dev->ctrl);
+        dev->ctrl = NULL;
+        return -ENOMEM;
+    }
+
+    dev->size = size;
+    dev->mask = size - 1;
+    dev->ctrl->size = size; // Пространство пользователя узнает емкость отсюда
+    return 0;
+}
+
+// Изменение емкости "на лету". Данные в буфере сохраняются: каждый байт
+// переносится на позицию своего счетчика по новой маске, поэтому head и
+// tail не меняются и читатели ioctl без блокировок не видят скачков
+static int scull_resize_ring(struct scull_buffer *dev, unsigned long new_size)
+{
+    u32 size = scull_ring_size(new_size);
+    u32 tail, data_size, done = 0;
+    char *buffer;
+    int retval = 0;
+
+    if (new_size > SCULL_MAX_SIZE)
+        return -EINVAL;
+
+    buffer = scull_vzalloc(dev, size, dev->numa_node);
+    if (!buffer)
+        return -ENOMEM;
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        vfree(buffer);
+        return -ERESTARTSYS;
+    }
+
+    // В режиме SPSC операции идут без мьютексов, в режиме MQ писатели
+    // берут мьютексы шардов, читатели режима BROADCAST не берут read_lock,
+    // а отображенные страницы нельзя подменить - в этих случаях емкость
+    // не меняется
+    if ((dev->mode & (SCULL_MODE_SPSC | SCULL_MODE_MQ | SCULL_MODE_BROADCAST)) ||
+        atomic_read(&dev->mmap_count)) {
+        retval = -EBUSY;
+        goto out;
+    }
+
+    // Останавливаем и читателей, и писателей на время переноса данных
+    mutex_lock(&dev->read_lock);
+    mutex_lock(&dev->write_lock);
+
+    tail = dev->ctrl->tail;
+    data_size = scull_data_size(dev);
+    if (data_size > size || data_size > dev->size) {
+        retval = data_size > dev->size ? -EIO : -ENOSPC;
+        goto out_unlock;
+    }
+
+    // Переносим данные кусками, каждый не пересекает конец ни старого,
+    // ни нового буфера
+    while (done < data_size) {
+        u32 from = (tail + done) & dev->mask;
+        u32 to = (tail + done) & (size - 1);
+        u32 n = min3(data_size - done, dev->size - from, size - to);
+
+        memcpy(buffer + to, dev->buffer + from, n);
+        done += n;
+    }
+
+    write_seqcount_begin(&dev->cfg_seq);
+    swap(dev->buffer, buffer);
+    WRITE_ONCE(dev->size, size);
+    dev->mask = size - 1;
+    WRITE_ONCE(dev->ctrl->size, size);
+    write_seqcount_end(&dev->cfg_seq);
+
+out_unlock:
+    mutex_unlock(&dev->write_lock);
+    mutex_unlock(&dev->read_lock);
+out:
+    mutex_unlock(&dev->lock);
+    vfree(buffer); // Старый буфер (или новый, если емкость не изменилась)
+
+    // Места могло стать больше - писатели должны пересчитать условие
+    if (!retval)
+        wake_up_interruptible_all(&dev->write_queue);
+    return retval;
+}
+
+// Выделение шардов режима MQ: по одному на CPU, емкость каждого -
+// доля емкости устройства size. Общего кольца и управляющей страницы
+// у устройства MQ нет: их никто не читает, а mmap в этом режиме запрещен
+static int scull_alloc_shards(struct scull_buffer *dev, u32 size)
+{
+    unsigned int i;
+
+    dev->nr_shards = min_t(unsigned int, nr_cpu_ids, SCULL_MQ_MAX_SHARDS);
+    // Емкость устройства делится между шардами, иначе 64 шарда по 512 МиБ
+    // заняли бы 32 ГиБ. Шард - степень двойки, но не меньше SCULL_MIN_SIZE
+    dev->shard_size = max_t(u32, rounddown_pow_of_two(size / dev->nr_shards),
+                            SCULL_MIN_SIZE);
+    dev->shard_mask = dev->shard_size - 1;
+    dev->shards = kcalloc(dev->nr_shards, sizeof(*dev->shards), GFP_KERNEL);
+    if (!dev->shards)
+        return -ENOMEM;
+
+    // В шард i пишут CPU i, i + nr_shards, ... - он на узле CPU i,
+    // если узел не задан явно
+    for (i = 0; i < dev->nr_shards; i++) {
+        int node = dev->numa_node;
+
+        if (node == NUMA_NO_NODE && cpu_possible(i))
+            node = cpu_to_node(i);
+        mutex_init(&dev->shards[i].lock);
+        dev->shards[i].buffer = scull_vzalloc(dev, dev->shard_size, node);
+        if (!dev->shards[i].buffer)
+            return -ENOMEM; // Уже выделенное освободит scull_free_ring
+    }
+
+    // Номера записей начинаются с 1: atomic_inc_return от 0
+    atomic_set(&dev->mq_seq, 0);
+    dev->mq_next_seq = 1;
+    dev->mq_rr = 0;
+    // Емкость устройства - то, что реально выделено. Из-за нижней границы
+    // шарда она бывает больше запрошенной: кольцо 4 КиБ на 8 CPU - 32 КиБ
+    dev->size = dev->nr_shards * dev->shard_size;
+    return 0;
+}
+
+// Освобождение памяти кольца
+static void scull_free_ring(struct scull_buffer *dev)
+{
+    unsigned int i;
+
+    if (dev->shards) {
+        for (i = 0; i < dev->nr_shards; i++)
+            vfree(dev->shards[i].buffer);
+        kfree(dev->shards);
+        dev->shards = NULL;
+    }
+    free_percpu(dev->stats);
+    free_percpu(dev->hist);
+    dev->stats = NULL;
+    dev->hist = NULL;
+    vfree(dev->buffer);
+    free_page((unsigned long)dev->ctrl);
+    dev->buffer = NULL;
+    dev->ctrl = NULL;
+}
+
+// Файл debugfs со статистикой устройства: суммы счетчиков по всем CPU,
+// высшая отметка заполнения и потери режима OVERWRITE
+static int scull_stats_show(struct seq_file *m, void *v)
+{
+    struct scull_buffer *dev = m->private;
+    struct scull_stats sum;
+
+    scull_stats_sum(dev, &sum);
+
+    seq_printf(m, "bytes_in:     %llu\n", sum.bytes_in);
+    seq_printf(m, "bytes_out:    %llu\n", sum.bytes_out);
+    seq_printf(m, "writes:       %llu\n", sum.writes);
+    seq_printf(m, "reads:        %llu\n", sum.reads);
+    seq_printf(m, "read_blocks:  %llu\n", sum.read_blocks);
+    seq_printf(m, "write_blocks: %llu\n", sum.write_blocks);
+    seq_printf(m, "busy_poll_hits:   %llu\n", sum.busy_poll_hits);
+    seq_printf(m, "busy_poll_misses: %llu\n", sum.busy_poll_misses);
+    seq_printf(m, "high_water:   %u\n", READ_ONCE(dev->high_water));
+    seq_printf(m, "capacity:     %u\n", READ_ONCE(dev->size));
+    seq_printf(m, "numa_node:    %d%s\n", READ_ONCE(dev->numa_node),
+               READ_ONCE(dev->numa_auto) ? " (first writer)" : "");
+    seq_printf(m, "huge_pages:   %d\n", dev->huge);
+    seq_printf(m, "lost_bytes:   %lld\n", (long long)atomic64_read(&dev->lost_bytes));
+    seq_printf(m, "lost_records: %lld\n", (long long)atomic64_read(&dev->lost_records));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+static const char * const scull_hist_names[SCULL_HIST_NR] = {
+    [SCULL_HIST_READ_WAIT] = "read_wait_ns",
+    [SCULL_HIST_WRITE_WAIT] = "write_wait_ns",
+    [SCULL_HIST_READ_HOLD] = "read_hold_ns",
+    [SCULL_HIST_WRITE_HOLD] = "write_hold_ns",
+    [SCULL_HIST_OCCUPANCY] = "occupancy_bytes",
+    [SCULL_HIST_WAKE_LAT] = "wake_latency_ns",
+    [SCULL_HIST_SPIN_LAT] = "spin_latency_ns",
+};
+
+// Файл debugfs с гистограммами: для каждой непустой корзины - границы
+// [от, до) и число попаданий (сумма по всем CPU)
+static int scull_hist_show(struct seq_file *m, void *v)
+{
+    struct scull_buffer *dev = m->private;
+    u64 sum[SCULL_HIST_BUCKETS];
+    int h, b, cpu;
+
+    for (h = 0; h < SCULL_HIST_NR; h++) {
+        memset(sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu) {
+            struct scull_hist *hist = per_cpu_ptr(dev->hist, cpu);
+
+            for (b = 0; b < SCULL_HIST_BUCKETS; b++)
+                sum[b] += READ_ONCE(hist->bucket[h][b]);
+        }
+
+        seq_printf(m, "%s:\n", scull_hist_names[h]);
+        for (b = 0; b < SCULL_HIST_BUCKETS; b++) {
+            if (!sum[b])
+                continue;
+            if (b == SCULL_HIST_BUCKETS - 1) // Последняя корзина без верхней границы
+                seq_printf(m, "  [%llu, inf) %llu\n", 1ULL << (b - 1), sum[b]);
+            else
+                seq_printf(m, "  [%llu, %llu) %llu\n", b ? 1ULL << (b - 1) : 0,
+                           1ULL << b, sum[b]);
+        }
+    }
+    return 0;
+}
+
+static int scull_hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, scull_hist_show, inode->i_private);
+}
+
+// Любая запись в файл обнуляет гистограммы (echo 0 > hist).
+// Обнуление идет без остановки операций, поэтому попадания, пришедшиеся
+// на сам момент сброса, могут остаться или потеряться
+static ssize_t scull_hist_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos)
+{
+    struct scull_buffer *dev = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->hist, cpu), 0, sizeof(struct scull_hist));
+    return count;
+}
+
+static const struct file_operations scull_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = scull_hist_open,
+    .read = seq_read,
+    .write = scull_hist_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Проверка режима нового устройства. Из SPSC, MQ и BROADCAST выбирается
+// не больше одного, и к ним подходят только их собственные флаги
+static int scull_check_mode(unsigned int mode)
+{
+    unsigned int base = mode & (SCULL_MODE_SPSC | SCULL_MODE_MQ | SCULL_MODE_BROADCAST);
+    unsigned int extra = mode & ~base;
+
+    if (base & (base - 1))
+        return -EINVAL;
+
+    switch (base) {
+    case SCULL_MODE_MQ:
+        return (extra & ~(SCULL_MODE_ORDERED | SCULL_MODE_BATCH)) ? -EINVAL : 0;
+    case SCULL_MODE_BROADCAST:
+        return (extra & ~SCULL_MODE_DROP_SLOW) ? -EINVAL : 0;
+    case SCULL_MODE_SPSC:
+        return extra ? -EINVAL : 0;
+    }
+
+    // Обычное кольцо: те же правила, что и у SCULL_IOC_SET_MODE
+    if (extra & ~(SCULL_MODE_FRAMED | SCULL_MODE_BATCH | SCULL_MODE_OVERWRITE))
+        return -EINVAL;
+    if ((extra & SCULL_MODE_BATCH) && !(extra & SCULL_MODE_FRAMED))
+        return -EINVAL;
+    return 0;
+}
+
+// Создание устройства /dev/scull_bufferN (N = minor) с емкостью size
+// (0 - по умолчанию) и режимом mode на узле NUMA node. Память кольца выделяется только здесь.
+// Вызывается под scull_devices_lock
+static struct scull_buffer *scull_create_dev(int minor, unsigned int size, unsigned int mode,
+                                             int node, bool huge)
+{
+    struct scull_buffer *dev;
+    char name[32];        // Имя устройства и его каталога в debugfs
+    int err;
+
+    if (node != NUMA_NO_NODE && node != SCULL_NUMA_AUTO &&
+        (node < 0 || node >= MAX_NUMNODES || !node_online(node)))
+        return ERR_PTR(-EINVAL);
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+
+    // Пока узел первого писателя неизвестен, память берется где угодно
+    dev->numa_auto = node == SCULL_NUMA_AUTO;
+    dev->numa_node = dev->numa_auto ? NUMA_NO_NODE : node;
+    dev->huge = huge;
+
+    // Выделяем память под кольцевой буфер и управляющую страницу,
+    // в режиме MQ - только под шарды
+    if (mode & SCULL_MODE_MQ)
+        err = scull_alloc_shards(dev, scull_ring_size(size));
+    else
+        err = scull_alloc_ring(dev, scull_ring_size(size));
+    if (err) {
+        pr_err("scull_buffer: Failed to allocate buffer for device %d\n", minor);
+        goto fail_ring; // Частично выделенные шарды освободит scull_free_ring
+    }
+
+    // Инициализируем мьютексы для синхронизации
+    mutex_init(&dev->lock);
+    mutex_init(&dev->read_lock);
+    mutex_init(&dev->write_lock);
+    seqcount_mutex_init(&dev->cfg_seq, &dev->lock);
+    // SPSC, MQ и BROADCAST задаются при создании и дальше не меняются
+    dev->mode = mode;
+    spin_lock_init(&dev->cursor_lock);
+    INIT_LIST_HEAD(&dev->cursors);
+    spin_lock_init(&dev->efd_lock);
+    mutex_init(&dev->rpc_lock);
+    INIT_LIST_HEAD(&dev->rpc_pending);
+    INIT_LIST_HEAD(&dev->rpc_active);
+    init_waitqueue_head(&dev->rpc_queue);
+
+    dev->stats = alloc_percpu(struct scull_stats);
+    dev->hist = alloc_percpu(struct scull_hist);
+    if (!dev->stats || !dev->hist) {
+        pr_err("scull_buffer: Failed to allocate stats for device %d\n", minor);
+        err = -ENOMEM;
+        goto fail_ring;
+    }
+
+    // По умолчанию будим на каждом байте, как раньше
+    dev->read_wm = 1;
+    dev->write_wm = 1;
+    // Инициализируем очереди ожидания для читателей и писателей
+    init_waitqueue_head(&dev->read_queue);
+    init_waitqueue_head(&dev->write_queue);
+    // Буфер изначально пуст: head и tail обнулены в scull_alloc_ring,
+    // остальные счетчики - в kzalloc
+
+    // Создаем полный номер устройства (major + minor)
+    dev->devno = MKDEV(major_num, minor);
+
+    // Выделяем cdev и связываем с файловыми операциями
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev) {
+        err = -ENOMEM;
+        goto fail_ring;
+    }
+    dev->cdev->ops = &scull_fops;
+    dev->cdev->owner = THIS_MODULE; // Устанавливаем владельца
+
+    // Добавляем символьное устройство в систему
+    err = cdev_add(dev->cdev, dev->devno, 1);
+    if (err) {
+        pr_err("scull_buffer: Error %d adding device %d\n", err, minor);
+        kobject_put(&dev->cdev->kobj); // Освобождает cdev
+        goto fail_ring;
+    }
+
+    // Создаем устройство в /dev через sysfs: /dev/scull_bufferN
+    device_create(scull_class, NULL, dev->devno, NULL, DEVICE_NAME "%d", minor);
+
+    // Статистика: /sys/kernel/debug/scull_buffer/scull_bufferN/{stats,hist}.
+    // Ошибки debugfs не мешают работе устройства
+    snprintf(name, sizeof(name), DEVICE_NAME "%d", minor);
+    dev->debugfs = debugfs_create_dir(name, scull_debugfs);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &scull_stats_fops);
+    debugfs_create_file("hist", 0644, dev->debugfs, dev, &scull_hist_fops);
+
+    devices[minor] = dev;
+    // Сообщаем об успешном создании устройства
+    pr_info("scull_buffer: Device /dev/scull_buffer%d created\n", minor);
+    return dev;
+
+fail_ring:
+    scull_free_ring(dev); // Освобождаем память буфера
+fail_free:
+    kfree(dev);
+    return ERR_PTR(err);
+}
+
+// Удаление устройства и освобождение его памяти. Вызывается под
+// scull_devices_lock, когда устройство никем не открыто
+static void scull_destroy_dev(struct scull_buffer *dev)
+{
+    int minor = MINOR(dev->devno);
+
+    // Сначала убираем debugfs: его файлы читают статистику устройства
+    debugfs_remove_recursive(dev->debugfs);
+    // Удаляем устройство из /dev
+    device_destroy(scull_class, dev->devno);
+    // Удаляем символьное устройство из системы. Сам cdev освободится,
+    // когда отпустят последнюю ссылку (chrdev_open/__fput), поэтому
+    // scull_buffer можно освобождать, как только его никто не открыл
+    cdev_del(dev->cdev);
+    // Освобождаем память буфера
+    scull_free_ring(dev);
+    kfree(dev);
+    devices[minor] = NULL;
+
+    pr_info("scull_buffer: Device /dev/scull_buffer%d destroyed\n", minor);
+}
+
+// Создание кольца через /dev/scull_control. Возвращает номер устройства
+static long scull_ctl_create(unsigned long arg)
+{
+    struct scull_ctl_create req;
+    struct scull_buffer *dev;
+    int minor, retval;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+    if (req.minor >= SCULL_MAX_DEVICES || req.capacity > SCULL_MAX_SIZE ||
+        (req.flags & ~SCULL_CTL_HUGE))
+        return -EINVAL;
+    retval = scull_check_mode(req.mode);
+    if (retval)
+        return retval;
+
+    mutex_lock(&scull_devices_lock);
+    if (req.minor >= 0) {
+        minor = req.minor;
+        if (devices[minor]) {
+            retval = -EEXIST;
+            goto out;
+        }
+    } else {
+        // Первый свободный номер
+        for (minor = 0; minor < SCULL_MAX_DEVICES && devices[minor]; minor++)
+            ;
+        if (minor == SCULL_MAX_DEVICES) {
+            retval = -ENOSPC;
+            goto out;
+        }
+    }
+
+    dev = scull_create_dev(minor, req.capacity, req.mode, req.numa_node,
+                           req.flags & SCULL_CTL_HUGE);
+    retval = IS_ERR(dev) ? PTR_ERR(dev) : minor;
+out:
+    mutex_unlock(&scull_devices_lock);
+    return retval;
+}
+
+// Удаление кольца через /dev/scull_control. Открытое устройство не
+// удаляется (-EBUSY), как и в loop-control
+static long scull_ctl_destroy(unsigned long arg)
+{
+    struct scull_buffer *dev;
+    int retval = 0;
+
+    if (arg >= SCULL_MAX_DEVICES)
+        return -EINVAL;
+
+    mutex_lock(&scull_devices_lock);
+    dev = devices[arg];
+    if (!dev)
+        retval = -ENODEV;
+    else if (dev->users)
+        retval = -EBUSY;
+    else
+        scull_destroy_dev(dev);
+    mutex_unlock(&scull_devices_lock);
+    return retval;
+}
+
+// Команды управляющего устройства /dev/scull_control
+static long scull_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case SCULL_CTL_CREATE: // Параметры кольца передаются в struct scull_ctl_create
+        return scull_ctl_create(arg);
+    case SCULL_CTL_DESTROY: // Номер устройства передается значением arg
+        return scull_ctl_destroy(arg);
+    case SCULL_IOC_SNAPSHOT: // Снимок всех устройств доступен и здесь
+        return scull_snapshot(arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations scull_ctl_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = scull_ctl_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+// Управляющее устройство /dev/scull_control (по образцу loop-control)
+static struct miscdevice scull_ctl_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "scull_control",
+    .fops = &scull_ctl_fops,
+};
+
 // Функция инициализации модуля (вызывается при загрузке)
 static int __init scull_init(void)
 {
     int i, err;           // Счетчик и переменная для ошибок
     dev_t dev_num = 0;    // Номер устройства
+    unsigned int mode;    // Режим очередного устройства
+    struct scull_buffer *dev;
 
-    // Запрашиваем динамическое выделение диапазона номеров устройств
-    // dev_num будет содержать первый номер, NUM_DEVICES - количество устройств
-    err = alloc_chrdev_region(&dev_num, 0, NUM_DEVICES, DEVICE_NAME);
+    // Запрашиваем динамическое выделение диапазона номеров устройств:
+    // номера нужны и под кольца, созданные позже через /dev/scull_control
+    err = alloc_chrdev_region(&dev_num, 0, SCULL_MAX_DEVICES, DEVICE_NAME);
     if (err < 0) {
         pr_err("scull_buffer: Failed to allocate device numbers\n");
         return err; // Возвращаем ошибку
@@ -281,51 +2471,35 @@ static int __init scull_init(void)
         goto fail_class; // Переходим к обработке ошибки
     }
 
-    // Инициализируем каждое устройство в цикле
-    for (i = 0; i < NUM_DEVICES; i++) {
-        struct scull_buffer *dev = &devices[i]; // Текущее устройство
-
-        // Выделяем память под кольцевой буфер в пространстве ядра
-        dev->buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
-        if (!dev->buffer) {
-            pr_err("scull_buffer: Failed to allocate buffer for device %d\n", i);
-            err = -ENOMEM; // Ошибка "Недостаточно памяти"
-            goto fail_device; // Переходим к обработке ошибки
-        }
+    // Каталог для статистики всех устройств
+    scull_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
 
-        // Инициализируем мьютекс для синхронизации
-        mutex_init(&dev->lock);
-        // Инициализируем очереди ожидания для читателей и писателей
-        init_waitqueue_head(&dev->read_queue);
-        init_waitqueue_head(&dev->write_queue);
-
-        // Инициализируем переменные буфера
-        dev->read_index = 0;   // Начинаем чтение с начала
-        dev->write_index = 0;  // Начинаем запись с начала
-        dev->data_size = 0;    // Буфер initially пуст
-
-        // Создаем полный номер устройства (major + minor)
-        // minor = i (0, 1 для двух устройств)
-        dev->devno = MKDEV(major_num, i);
-
-        // Инициализируем структуру cdev и связываем с файловыми операциями
-        cdev_init(&dev->cdev, &scull_fops);
-        dev->cdev.owner = THIS_MODULE; // Устанавливаем владельца
-
-        // Добавляем символьное устройство в систему
-        err = cdev_add(&dev->cdev, dev->devno, 1);
-        if (err) {
-            pr_err("scull_buffer: Error %d adding device %d\n", err, i);
-            kfree(dev->buffer); // Освобождаем память буфера
+    // Создаем устройства, заданные при загрузке
+    mutex_lock(&scull_devices_lock);
+    for (i = 0; i < NUM_DEVICES; i++) {
+        // Режим задается параметрами модуля
+        if (mq[i])
+            mode = SCULL_MODE_MQ | (mq[i] > 1 ? SCULL_MODE_ORDERED : 0);
+        else if (broadcast[i])
+            mode = SCULL_MODE_BROADCAST | (broadcast[i] > 1 ? SCULL_MODE_DROP_SLOW : 0);
+        else
+            mode = spsc[i] ? SCULL_MODE_SPSC : 0;
+
+        dev = scull_create_dev(i, buffer_size[i], mode, ring_node[i], huge_pages[i]);
+        if (IS_ERR(dev)) {
+            err = PTR_ERR(dev);
             goto fail_device; // Переходим к обработке ошибки
         }
-
-        // Создаем устройство в /dev через sysfs
-        // Автоматически создается /dev/scull_buffer0, /dev/scull_buffer1 и т.д.
-        device_create(scull_class, NULL, dev->devno, NULL, "scull_buffer%d", i);
-
-        // Сообщаем об успешном создании устройства
-        pr_info("scull_buffer: Device /dev/scull_buffer%d created\n", i);
+    }
+    mutex_unlock(&scull_devices_lock);
+
+    // Управляющее устройство регистрируем последним: после него кольца
+    // могут создаваться в любой момент
+    err = misc_register(&scull_ctl_misc);
+    if (err) {
+        pr_err("scull_buffer: Failed to register /dev/scull_control\n");
+        mutex_lock(&scull_devices_lock);
+        goto fail_device;
     }
 
     // Финальное сообщение об успешной загрузке модуля
@@ -334,22 +2508,20 @@ static int __init scull_init(void)
 
 // Метка обработки ошибок при создании устройств
 fail_device:
-    // Откат: удаляем все созданные устройства в обратном порядке
-    while (--i >= 0) {
-        // Удаляем устройство из /dev
-        device_destroy(scull_class, devices[i].devno);
-        // Удаляем символьное устройство из системы
-        cdev_del(&devices[i].cdev);
-        // Освобождаем память буфера
-        kfree(devices[i].buffer);
+    // Откат: удаляем все созданные устройства
+    for (i = 0; i < SCULL_MAX_DEVICES; i++) {
+        if (devices[i])
+            scull_destroy_dev(devices[i]);
     }
+    mutex_unlock(&scull_devices_lock);
+    debugfs_remove_recursive(scull_debugfs);
     // Удаляем класс устройств
     class_destroy(scull_class);
 
 // Метка обработки ошибок при создании класса
 fail_class:
     // Освобождаем выделенные номера устройств
-    unregister_chrdev_region(dev_num, NUM_DEVICES);
+    unregister_chrdev_region(dev_num, SCULL_MAX_DEVICES);
     return err; // Возвращаем код ошибки
 }
 
@@ -358,49 +2530,332 @@ static void __exit scull_exit(void)
 {
     int i; // Счетчик
 
-    // Удаляем все устройства в цикле
-    for (i = 0; i < NUM_DEVICES; i++) {
-        // Удаляем устройство из /dev
-        device_destroy(scull_class, devices[i].devno);
-        // Удаляем символьное устройство из системы
-        cdev_del(&devices[i].cdev);
-        // Освобождаем память буфера
-        kfree(devices[i].buffer);
+    // Новые кольца больше не создаются
+    misc_deregister(&scull_ctl_misc);
+
+    // Удаляем все устройства, в том числе созданные через /dev/scull_control.
+    // Модуль не выгружается, пока устройства открыты, поэтому они свободны
+    mutex_lock(&scull_devices_lock);
+    for (i = 0; i < SCULL_MAX_DEVICES; i++) {
+        if (devices[i])
+            scull_destroy_dev(devices[i]);
     }
+    mutex_unlock(&scull_devices_lock);
 
+    debugfs_remove_recursive(scull_debugfs);
     // Удаляем класс устройств
     class_destroy(scull_class);
     // Освобождаем номера устройств
-    unregister_chrdev_region(MKDEV(major_num, 0), NUM_DEVICES);
+    unregister_chrdev_region(MKDEV(major_num, 0), SCULL_MAX_DEVICES);
 
     // Сообщение о успешной выгрузке модуля
     pr_info("scull_buffer: Module unloaded\n");
 }
 
+// Ожидание условия для процессов, работающих с кольцом через mmap.
+// Возвращает текущее значение (данные или свободное место) либо ошибку
+static long scull_wait_level(struct file *filp, wait_queue_head_t *queue,
+                             u32 (*level)(struct scull_buffer *), unsigned long want)
+{
+    struct scull_buffer *dev = filp->private_data;
+    u32 cur;
+
+    // Ждать больше, чем емкость кольца, бессмысленно
+    want = clamp_t(unsigned long, want, 1, READ_ONCE(dev->size));
+
+    cur = level(dev);
+    if (cur >= want)
+        return cur;
+
+    if (filp->f_flags & O_NONBLOCK)
+        return -EAGAIN;
+
+    if (wait_event_interruptible(*queue, (cur = level(dev)) >= want))
+        return -ERESTARTSYS;
+
+    return cur;
+}
+
 // Добавим ioctl для Process C, чтобы получать состояние буфера
+// Снимок одного устройства без мьютексов. Емкость, режим и объем данных
+// согласованы через cfg_seq: если во время чтения поменяли емкость или
+// режим, снимок повторяется. Счетчики читаются без блокировок
+static void scull_snap_dev(struct scull_buffer *dev, struct scull_dev_snap *snap)
+{
+    struct scull_stats sum;
+    unsigned int seq;
+
+    memset(snap, 0, sizeof(*snap));
+    do {
+        seq = read_seqcount_begin(&dev->cfg_seq);
+        snap->mode = READ_ONCE(dev->mode);
+        snap->capacity = READ_ONCE(dev->size);
+        snap->data_size = (snap->mode & SCULL_MODE_MQ) ?
+                          scull_mq_data_size(dev) : scull_data_size(dev);
+    } while (read_seqcount_retry(&dev->cfg_seq, seq));
+
+    scull_stats_sum(dev, &sum);
+    snap->minor = MINOR(dev->devno);
+    snap->high_water = READ_ONCE(dev->high_water);
+    snap->read_waiters = atomic_read(&dev->read_waiters);
+    snap->write_waiters = atomic_read(&dev->write_waiters);
+    snap->bytes_in = sum.bytes_in;
+    snap->bytes_out = sum.bytes_out;
+    snap->writes = sum.writes;
+    snap->reads = sum.reads;
+    snap->read_blocks = sum.read_blocks;
+    snap->write_blocks = sum.write_blocks;
+    snap->lost_bytes = atomic64_read(&dev->lost_bytes);
+}
+
+// Снимок всех устройств за один системный вызов (для монитора process_c).
+// Не берет мьютексов устройств и не мешает чтению и записи
+static long scull_snapshot(unsigned long arg)
+{
+    struct scull_snap_req __user *ureq = (struct scull_snap_req __user *)arg;
+    struct scull_dev_snap __user *entries;
+    struct scull_snap_req req;
+    struct scull_dev_snap snap;
+    int retval = 0;
+    u32 i;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    entries = u64_to_user_ptr(req.entries);
+
+    // scull_devices_lock держит устройства от удаления, но данные не трогает
+    mutex_lock(&scull_devices_lock);
+    req.nr = 0;
+    for (i = 0; i < SCULL_MAX_DEVICES; i++) {
+        if (!devices[i])
+            continue;
+        if (req.nr < req.max) {
+            scull_snap_dev(devices[i], &snap);
+            if (copy_to_user(&entries[req.nr], &snap, sizeof(snap))) {
+                retval = -EFAULT;
+                break;
+            }
+        }
+        req.nr++;
+    }
+    mutex_unlock(&scull_devices_lock);
+
+    if (!retval && copy_to_user(&ureq->nr, &req.nr, sizeof(req.nr)))
+        retval = -EFAULT;
+    return retval;
+}
+
 static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct scull_buffer *dev = filp->private_data; // Получаем наше устройство
     int retval = 0;
-
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    int data_size;
+    u32 capacity;
 
     switch (cmd) {
-    case 0: // Команда для получения размера данных в буфере
-        if (copy_to_user((int __user *)arg, &dev->data_size, sizeof(dev->data_size))) {
+    case SCULL_IOC_GET_SIZE: // Команда для получения размера данных в буфере
+        data_size = (dev->mode & SCULL_MODE_MQ) ? scull_mq_data_size(dev) : scull_data_size(dev);
+        if (copy_to_user((int __user *)arg, &data_size, sizeof(data_size))) {
+            retval = -EFAULT;
+        }
+        break;
+    case SCULL_IOC_WAIT_DATA: // Блокировка читателя, работающего через mmap
+        if (dev->mode & SCULL_MODE_MQ)
+            return -EOPNOTSUPP; // Кольца для mmap у устройства MQ нет
+        return scull_wait_level(filp, &dev->read_queue, scull_data_size, arg);
+    case SCULL_IOC_WAIT_SPACE: // Блокировка писателя, работающего через mmap
+        if (dev->mode & SCULL_MODE_MQ)
+            return -EOPNOTSUPP;
+        return scull_wait_level(filp, &dev->write_queue, scull_space_available, arg);
+    case SCULL_IOC_NOTIFY: // Процесс сдвинул head/tail в mmap - будим другую сторону
+        if (dev->mode & SCULL_MODE_MQ)
+            return -EOPNOTSUPP;
+        wake_up_interruptible_all(&dev->read_queue);
+        wake_up_interruptible_all(&dev->write_queue);
+        scull_efd_check(dev, SCULL_EFD_DATA);
+        scull_efd_check(dev, SCULL_EFD_SPACE);
+        break;
+    case SCULL_IOC_GET_CAPACITY: // Команда для получения емкости кольца
+        capacity = READ_ONCE(dev->size);
+        if (copy_to_user((u32 __user *)arg, &capacity, sizeof(capacity))) {
+            retval = -EFAULT;
+        }
+        break;
+    case SCULL_IOC_SET_CAPACITY: // Новая емкость передается значением arg
+        return scull_resize_ring(dev, arg);
+    case SCULL_IOC_GET_MODE: // Команда для получения режима работы
+        if (put_user(READ_ONCE(dev->mode), (unsigned int __user *)arg)) {
             retval = -EFAULT;
         }
         break;
+    case SCULL_IOC_SET_MODE: // Новый режим передается значением arg
+        return scull_set_mode(dev, arg);
+    case SCULL_IOC_SNAPSHOT: // Снимок всех устройств, а не только этого
+        return scull_snapshot(arg);
+    case SCULL_IOC_GET_LOST: { // Команда для получения счетчиков потерь
+        struct scull_lost lost = {
+            .bytes = atomic64_read(&dev->lost_bytes),
+            .records = atomic64_read(&dev->lost_records),
+        };
+
+        if (copy_to_user((void __user *)arg, &lost, sizeof(lost))) {
+            retval = -EFAULT;
+        }
+        break;
+    }
+    case SCULL_IOC_RPC_CALL: // Запрос и буфер ответа передаются в struct scull_rpc
+        return scull_rpc_call(dev, (struct scull_rpc __user *)arg);
+    case SCULL_IOC_RPC_SERVE: // Ответ и буфер следующего запроса - в struct scull_rpc
+        return scull_rpc_serve(dev, filp, (struct scull_rpc __user *)arg);
+    case SCULL_IOC_EVENTFD: // Дескриптор, событие и порог - в struct scull_eventfd
+        return scull_efd_bind(dev, filp, (struct scull_eventfd __user *)arg);
+    case SCULL_IOC_SET_BUSY_POLL: // Бюджет спина в мкс передается значением arg
+        if (arg > SCULL_BUSY_POLL_MAX_US)
+            return -EINVAL;
+        WRITE_ONCE(dev->busy_poll_us, arg);
+        break;
+    case SCULL_IOC_SET_READ_WM: // Порог передается значением arg
+    case SCULL_IOC_SET_WRITE_WM:
+        if (arg > SCULL_MAX_SIZE)
+            return -EINVAL;
+        if (cmd == SCULL_IOC_SET_READ_WM)
+            WRITE_ONCE(dev->read_wm, max_t(u32, arg, 1));
+        else
+            WRITE_ONCE(dev->write_wm, max_t(u32, arg, 1));
+        // Условия ожидания изменились - пусть спящие проверят их заново
+        wake_up_interruptible_all(&dev->read_queue);
+        wake_up_interruptible_all(&dev->write_queue);
+        break;
     // Можно добавить другие команды, например, для чтения всего содержимого без извлечения
     default:
         retval = -ENOTTY;
     }
 
-    mutex_unlock(&dev->lock);
     return retval;
 }
 
+// Поддержка poll/select/epoll. Устройство готово к чтению, когда в нем
+// не меньше read_wm байт, и к записи, когда свободно не меньше write_wm
+static __poll_t scull_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_buffer *dev = filp->private_data;
+    struct scull_mq_hdr hdr;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->read_queue, wait);
+    poll_wait(filp, &dev->write_queue, wait);
+
+    // В режиме BROADCAST готовность к чтению своя у каждого читателя
+    if ((dev->mode & SCULL_MODE_BROADCAST) && (filp->f_mode & FMODE_READ)) {
+        struct scull_cursor *cursor;
+
+        spin_lock(&dev->cursor_lock);
+        cursor = scull_bcast_cursor(dev, filp);
+        spin_unlock(&dev->cursor_lock);
+        if (cursor && READ_ONCE(cursor->dropped))
+            mask |= EPOLLERR;
+        else if (cursor && scull_bcast_ready(dev, cursor))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (scull_space_available(dev) >= scull_write_lowat(dev))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+    }
+
+    // В режиме MQ читать можно, когда есть целая запись для выдачи,
+    // а писать - когда в шарде текущего CPU свободно не меньше write_wm
+    if (dev->mode & SCULL_MODE_MQ) {
+        if (scull_mq_next(dev, &hdr))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (dev->shard_size - scull_shard_data(scull_mq_this_shard(dev)) >=
+            min(scull_write_lowat(dev), dev->shard_size))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+    }
+
+    if (scull_data_size(dev) >= scull_read_lowat(dev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (scull_space_available(dev) >= scull_write_lowat(dev))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+// Открытие/закрытие отображения: считаем активные mmap устройства
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_buffer *dev = vma->vm_private_data;
+    atomic_inc(&dev->mmap_count);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_buffer *dev = vma->vm_private_data;
+    atomic_dec(&dev->mmap_count);
+}
+
+// Обработчик страничного сбоя: страница 0 - управляющая,
+// страницы 1..N - страницы кольцевого буфера
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+    struct scull_buffer *dev = vmf->vma->vm_private_data;
+    struct page *page;
+
+    if (vmf->pgoff == 0) {
+        page = virt_to_page(dev->ctrl);
+    } else {
+        unsigned long offset = (vmf->pgoff - 1) << PAGE_SHIFT;
+
+        if (offset >= dev->size)
+            return VM_FAULT_SIGBUS;
+        page = vmalloc_to_page(dev->buffer + offset);
+    }
+
+    get_page(page); // Страница остается жить, пока отображена
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+    .open = scull_vma_open,
+    .close = scull_vma_close,
+    .fault = scull_vma_fault,
+};
+
+// Отображение кольца в пространство пользователя (без копирований).
+// Процесс пишет/читает данные на месте и двигает head/tail в управляющей
+// странице, а устройство использует только для ожидания и пробуждения
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_buffer *dev = filp->private_data;
+    unsigned long pages = vma_pages(vma);
+
+    // У шардов режима MQ нет общей управляющей страницы, а в режиме
+    // BROADCAST tail принадлежит курсорам читателей
+    if (dev->mode & (SCULL_MODE_MQ | SCULL_MODE_BROADCAST))
+        return -ENODEV;
+
+    // Под мьютексом настройки: емкость не меняется, пока создаем отображение
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    // Не даем отобразить больше, чем управляющая страница и буфер
+    if (vma->vm_pgoff + pages > 1 + (dev->size >> PAGE_SHIFT)) {
+        mutex_unlock(&dev->lock);
+        return -EINVAL;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    vma->vm_ops = &scull_vm_ops;
+    vma->vm_private_data = dev;
+    scull_vma_open(vma);
+    mutex_unlock(&dev->lock);
+    return 0;
+}
+
 // Указываем функции инициализации и очистки
 module_init(scull_init); // Функция scull_init будет вызвана при загрузке модуля
 module_exit(scull_exit); // Функция scull_exit будет вызвана при выгрузке модуля
@@ -0,0 +1,79 @@
+// Точки трассировки драйвера scull_buffer.
+// Включаются через tracefs, например:
+//   echo 1 > /sys/kernel/tracing/events/scull_buffer/enable
+//   cat /sys/kernel/tracing/trace_pipe
+// Выключенная точка стоит одну проверку static key, без форматирования текста
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull_buffer
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Данные положены в кольцо (enqueue) или забраны из него (dequeue)
+DECLARE_EVENT_CLASS(scull_xfer,
+    TP_PROTO(unsigned int minor, size_t bytes, u32 data_size),
+    TP_ARGS(minor, bytes, data_size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)    // Номер устройства
+        __field(size_t, bytes)          // Сколько байт передано
+        __field(u32, data_size)         // Сколько данных осталось в кольце
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->bytes = bytes;
+        __entry->data_size = data_size;
+    ),
+
+    TP_printk("dev=%u bytes=%zu data_size=%u",
+              __entry->minor, __entry->bytes, __entry->data_size)
+);
+
+DEFINE_EVENT(scull_xfer, scull_enqueue,
+    TP_PROTO(unsigned int minor, size_t bytes, u32 data_size),
+    TP_ARGS(minor, bytes, data_size));
+
+DEFINE_EVENT(scull_xfer, scull_dequeue,
+    TP_PROTO(unsigned int minor, size_t bytes, u32 data_size),
+    TP_ARGS(minor, bytes, data_size));
+
+// Процесс уходит спать в очереди ожидания (sleep) или проснулся (wakeup)
+DECLARE_EVENT_CLASS(scull_wait,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)    // Номер устройства
+        __field(bool, writer)           // Писатель (true) или читатель
+        __field(pid_t, pid)             // Кто спит
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->writer = writer;
+        __entry->pid = current->pid;
+    ),
+
+    TP_printk("dev=%u %s pid=%d", __entry->minor,
+              __entry->writer ? "writer" : "reader", __entry->pid)
+);
+
+DEFINE_EVENT(scull_wait, scull_sleep,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer));
+
+DEFINE_EVENT(scull_wait, scull_wakeup,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer));
+
+#endif // _SCULL_TRACE_H
+
+// Заголовок лежит рядом с драйвером, а не в include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
@@ -8,96 +8,808 @@
 #include <linux/skbuff.h>
 #include <linux/types.h>
 #include <linux/byteorder/generic.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/inet.h>
+#include <linux/uaccess.h>
+#include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h> // PACKET_OUTGOING
+#include <linux/interrupt.h>
+#include <net/net_namespace.h>
+#include <net/checksum.h>    // inet_proto_csum_replace2
+#include <net/ip.h>          // ip_hdrlen, ip_is_fragment
+
+// Точки трассировки (match, mirror, fail) вместо printk на каждый пакет
+#define CREATE_TRACE_POINTS
+#include "span_trace.h"
 
 static struct nf_hook_ops nfho;
-static __be16 target_port = htons(8808);
+
+// Режим SPAN: все кадры, принятые на source_if, без изменений уходят
+// копией в mirror_if. Копии снимает отвод ETH_P_ALL на source_if, как у
+// tcpdump, еще до IP: зеркалируется любой протокол, а в promiscuous mode
+// и кадры для чужих хостов, которые ip_rcv выбросил бы до PRE_ROUTING.
+// Правила на это зеркало не влияют. Интерфейсы можно создать и после
+// загрузки модуля
+static char source_if[IFNAMSIZ];
+module_param_string(source_if, source_if, sizeof(source_if), 0444);
+MODULE_PARM_DESC(source_if, "Interface whose received frames are mirrored (SPAN source)");
+
+static char mirror_if[IFNAMSIZ];
+module_param_string(mirror_if, mirror_if, sizeof(mirror_if), 0444);
+MODULE_PARM_DESC(mirror_if, "Interface the mirrored traffic is transmitted on (SPAN destination)");
+
+// Метка копий SPAN ("SPAN"). Копия, ушедшая в mirror_if, может вернуться
+// на source_if (например, через пару veth) - по метке хук ее выбрасывает
+#define SPAN_MIRROR_MARK 0x5350414e
+
+// Метка копий с новым портом ("SPRJ"). Копия снова проходит PRE_ROUTING,
+// и без метки правило вида 8807 -> 8807 или пара 8807 -> 8808 и
+// 8808 -> 8807 порождали бы копию от каждой копии без конца
+#define SPAN_REINJECT_MARK 0x5350524a
+
+static int span_source_ifindex;                 // ifindex source_if, 0 - нет
+static struct packet_type span_tap;             // Отвод кадров source_if (под RTNL)
+static bool span_tap_added;                     // Отвод зарегистрирован (под RTNL)
+static struct net_device __rcu *span_mirror_dev; // mirror_if (со ссылкой), NULL - нет
+
+// Отложенные очереди копий на каждом CPU. Хук и отвод только ставят копию
+// в очередь, тасклет разбирает очереди пачками не больше budget пакетов,
+// как опрос NAPI. Копии SPAN уходят пачкой в mirror_if: драйвер получает
+// подсказку xmit_more и звонит в "дверной звонок" устройства один раз на
+// пачку. Копии с новым портом вводятся в стек уже вне хука PRE_ROUTING.
+// Хук, отвод и тасклет - все softirq одного CPU, поэтому очереди без блокировки
+struct span_queue {
+    struct sk_buff_head xmit;       // Копии SPAN для mirror_if
+    struct sk_buff_head reinject;   // Копии для повторного ввода в стек
+    struct tasklet_struct tasklet;
+};
+static DEFINE_PER_CPU(struct span_queue, span_queue);
+
+// Наибольшая длина каждой очереди; лишние копии выбрасываются
+static unsigned int queue_len = 1000;
+module_param(queue_len, uint, 0644);
+MODULE_PARM_DESC(queue_len, "Per-CPU limit of deferred copies in each queue; overflow is dropped");
+
+// Сколько пакетов каждой очереди тасклет разбирает за один запуск.
+// Остаток ждет следующего запуска, и другие softirq не голодают
+static unsigned int budget = 64;
+module_param(budget, uint, 0644);
+MODULE_PARM_DESC(budget, "Copies taken from each per-CPU queue per softirq run");
+
+// Правила зеркалирования: (протокол, адрес/префикс назначения, порт
+// назначения) -> новый порт копии. Хук ищет правило без блокировок под
+// RCU. Ключ хэша - (протокол, порт, адрес по маске, префикс), поэтому
+// на каждую длину префикса, которая есть в таблице, нужна одна проба:
+// не больше 33 проб от длинного префикса к короткому, сколько бы правил
+// ни было. Правила задаются через /proc/net/span_rules
+#define SPAN_RULE_BITS 12
+#define SPAN_MAX_RULES 65536
+
+struct span_rule {
+    struct hlist_node node;     // Элемент span_rules
+    struct rcu_head rcu;        // Освобождение после выхода читателей
+    u8 protocol;                // IPPROTO_TCP или IPPROTO_UDP
+    u8 prefix;                  // Длина префикса адреса (0-32)
+    __be32 daddr;               // Адрес назначения (уже по маске)
+    __be16 dport;               // Порт назначения
+    __be16 new_port;            // Порт назначения копии
+};
+
+static DEFINE_HASHTABLE(span_rules, SPAN_RULE_BITS);
+static DEFINE_MUTEX(span_rules_lock);   // Сериализует изменения таблицы
+static unsigned int span_nr_rules;      // Сколько правил (под span_rules_lock)
+static unsigned int span_prefix_rules[33]; // Сколько правил с каждой длиной префикса
+static u64 span_prefixes;               // Бит p - есть правила с префиксом p (читается без блокировки)
+
+// Счетчики пакетов. Хук работает на всех CPU сразу, поэтому у каждого
+// CPU свои счетчики; /proc/net/span_driver их суммирует
+struct span_stats {
+    u64 seen;           // Сколько пакетов прошло через хук
+    u64 matched;        // Сколько совпало с фильтром
+    u64 mirrored;       // Сколько копий отправлено
+    u64 copy_fail;      // Не удалось скопировать пакет
+    u64 reinject_fail;  // Стек не принял копию
+    u64 spanned;        // Сколько копий SPAN отправлено в mirror_if
+    u64 span_fail;      // Копия SPAN не ушла (нет mirror_if, очередь устройства полна)
+    u64 queue_drops;    // Копия выброшена: отложенная очередь полна
+};
+static DEFINE_PER_CPU(struct span_stats, span_stats);
+
+// Вывод /proc/net/span_driver: строка "имя значение" на счетчик
+static int span_stats_show(struct seq_file *m, void *v) {
+    struct span_stats sum = { 0 };
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        const struct span_stats *st = per_cpu_ptr(&span_stats, cpu);
+
+        sum.seen += READ_ONCE(st->seen);
+        sum.matched += READ_ONCE(st->matched);
+        sum.mirrored += READ_ONCE(st->mirrored);
+        sum.copy_fail += READ_ONCE(st->copy_fail);
+        sum.reinject_fail += READ_ONCE(st->reinject_fail);
+        sum.spanned += READ_ONCE(st->spanned);
+        sum.span_fail += READ_ONCE(st->span_fail);
+        sum.queue_drops += READ_ONCE(st->queue_drops);
+    }
+
+    seq_printf(m, "seen %llu\n", sum.seen);
+    seq_printf(m, "matched %llu\n", sum.matched);
+    seq_printf(m, "mirrored %llu\n", sum.mirrored);
+    seq_printf(m, "copy_fail %llu\n", sum.copy_fail);
+    seq_printf(m, "reinject_fail %llu\n", sum.reinject_fail);
+    seq_printf(m, "spanned %llu\n", sum.spanned);
+    seq_printf(m, "span_fail %llu\n", sum.span_fail);
+    seq_printf(m, "queue_drops %llu\n", sum.queue_drops);
+    return 0;
+}
+
+// Маска префикса длины prefix
+static inline __be32 span_prefix_mask(unsigned int prefix) {
+    return prefix ? htonl(~0U << (32 - prefix)) : 0;
+}
+
+// Ключ хэша правила. daddr - уже по маске префикса
+static inline u32 span_rule_key(u8 protocol, __be16 dport, __be32 daddr, u8 prefix) {
+    return jhash_3words((__force u32)daddr, ((u32)protocol << 16) | ntohs(dport), prefix, 0);
+}
+
+// Поиск правила для пакета под RCU. Пробуем длины префиксов, которые
+// есть в таблице, от самой длинной: первое совпадение - самый длинный
+// префикс. Возвращает новый порт копии или 0, если правила нет
+static __be16 span_rule_match(u8 protocol, __be32 daddr, __be16 dport) {
+    u64 prefixes = READ_ONCE(span_prefixes);
+    struct span_rule *rule;
+    __be16 new_port = 0;
+    __be32 addr;
+    u8 prefix;
+
+    rcu_read_lock();
+    while (prefixes) {
+        prefix = fls64(prefixes) - 1;
+        prefixes &= ~BIT_ULL(prefix);
+        addr = daddr & span_prefix_mask(prefix);
+        hash_for_each_possible_rcu(span_rules, rule, node,
+                                   span_rule_key(protocol, dport, addr, prefix)) {
+            if (rule->protocol == protocol && rule->dport == dport &&
+                rule->daddr == addr && rule->prefix == prefix) {
+                new_port = READ_ONCE(rule->new_port);
+                goto out;
+            }
+        }
+    }
+out:
+    rcu_read_unlock();
+    return new_port;
+}
+
+// Учет длины префикса добавленного (delta = 1) или удаленного правила.
+// Вызывается под span_rules_lock
+static void span_prefix_account(u8 prefix, int delta) {
+    span_prefix_rules[prefix] += delta;
+    if (span_prefix_rules[prefix])
+        WRITE_ONCE(span_prefixes, span_prefixes | BIT_ULL(prefix));
+    else
+        WRITE_ONCE(span_prefixes, span_prefixes & ~BIT_ULL(prefix));
+}
+
+// Правило с тем же ключом и префиксом. Вызывается под span_rules_lock
+static struct span_rule *span_rule_find(const struct span_rule *key) {
+    struct span_rule *rule;
+
+    hash_for_each_possible(span_rules, rule, node,
+                           span_rule_key(key->protocol, key->dport, key->daddr, key->prefix)) {
+        if (rule->protocol == key->protocol && rule->dport == key->dport &&
+            rule->daddr == key->daddr && rule->prefix == key->prefix)
+            return rule;
+    }
+    return NULL;
+}
+
+// Добавление правила или замена порта копии у существующего
+static int span_rule_add(const struct span_rule *key) {
+    struct span_rule *rule;
+    int err = 0;
+
+    mutex_lock(&span_rules_lock);
+    rule = span_rule_find(key);
+    if (rule) {
+        WRITE_ONCE(rule->new_port, key->new_port);
+        goto out;
+    }
+    if (span_nr_rules >= SPAN_MAX_RULES) {
+        err = -ENOSPC;
+        goto out;
+    }
+    rule = kmemdup(key, sizeof(*key), GFP_KERNEL);
+    if (!rule) {
+        err = -ENOMEM;
+        goto out;
+    }
+    hash_add_rcu(span_rules, &rule->node,
+                 span_rule_key(rule->protocol, rule->dport, rule->daddr, rule->prefix));
+    span_nr_rules++;
+    // Бит префикса - после того как правило видно в таблице
+    span_prefix_account(rule->prefix, 1);
+out:
+    mutex_unlock(&span_rules_lock);
+    return err;
+}
+
+static int span_rule_del(const struct span_rule *key) {
+    struct span_rule *rule;
+
+    mutex_lock(&span_rules_lock);
+    rule = span_rule_find(key);
+    if (rule) {
+        hash_del_rcu(&rule->node);
+        span_nr_rules--;
+        span_prefix_account(rule->prefix, -1);
+        // Хук может еще читать правило - освобождаем после grace period
+        kfree_rcu(rule, rcu);
+    }
+    mutex_unlock(&span_rules_lock);
+    return rule ? 0 : -ENOENT;
+}
+
+static void span_rules_flush(void) {
+    struct span_rule *rule;
+    struct hlist_node *tmp;
+    int bkt;
+
+    mutex_lock(&span_rules_lock);
+    hash_for_each_safe(span_rules, bkt, tmp, rule, node) {
+        hash_del_rcu(&rule->node);
+        kfree_rcu(rule, rcu);
+    }
+    span_nr_rules = 0;
+    memset(span_prefix_rules, 0, sizeof(span_prefix_rules));
+    WRITE_ONCE(span_prefixes, 0);
+    mutex_unlock(&span_rules_lock);
+}
+
+// Разбор одной команды /proc/net/span_rules:
+//   add <tcp|udp> <адрес>[/префикс] <порт> <новый порт>
+//   del <tcp|udp> <адрес>[/префикс] <порт>
+//   flush
+static int span_rule_parse(char *line) {
+    struct span_rule key = { 0 };
+    char cmd[8], proto[4], addr[16];
+    unsigned int prefix = 32, port, new_port = 0;
+    char *slash;
+    int n;
+
+    n = sscanf(line, "%7s %3s %15s %u %u", cmd, proto, addr, &port, &new_port);
+    if (n == 1 && !strcmp(cmd, "flush")) {
+        span_rules_flush();
+        return 0;
+    }
+    if (n < 4)
+        return -EINVAL;
+
+    if (!strcmp(proto, "tcp"))
+        key.protocol = IPPROTO_TCP;
+    else if (!strcmp(proto, "udp"))
+        key.protocol = IPPROTO_UDP;
+    else
+        return -EINVAL;
+
+    slash = strchr(addr, '/');
+    if (slash) {
+        *slash = '\0';
+        if (kstrtouint(slash + 1, 10, &prefix) || prefix > 32)
+            return -EINVAL;
+    }
+    if (!in4_pton(addr, -1, (u8 *)&key.daddr, -1, NULL))
+        return -EINVAL;
+    if (port > 65535 || new_port > 65535)
+        return -EINVAL;
+    // Копия совпала бы с тем же правилом
+    if (n == 5 && new_port == port)
+        return -EINVAL;
+
+    key.prefix = prefix;
+    key.daddr &= span_prefix_mask(prefix);
+    key.dport = htons(port);
+    key.new_port = htons(new_port);
+
+    if (n == 5 && !strcmp(cmd, "add") && new_port)
+        return span_rule_add(&key);
+    if (n == 4 && !strcmp(cmd, "del"))
+        return span_rule_del(&key);
+    return -EINVAL;
+}
+
+// Запись в /proc/net/span_rules: одна или несколько команд по строкам
+static ssize_t span_rules_write(struct file *file, const char __user *ubuf,
+                                size_t count, loff_t *ppos) {
+    char *buf, *pos, *line;
+    int err = 0;
+
+    if (count >= PAGE_SIZE)
+        return -E2BIG;
+    buf = memdup_user_nul(ubuf, count);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    pos = buf;
+    while ((line = strsep(&pos, "\n")) != NULL) {
+        if (!*skip_spaces(line))
+            continue; // Пустая строка
+        err = span_rule_parse(line);
+        if (err)
+            break;
+    }
+    kfree(buf);
+    return err ? err : count;
+}
+
+// Чтение /proc/net/span_rules: правила в формате команды add
+static int span_rules_show(struct seq_file *m, void *v) {
+    struct span_rule *rule;
+    int bkt;
+
+    mutex_lock(&span_rules_lock);
+    hash_for_each(span_rules, bkt, rule, node) {
+        seq_printf(m, "%s %pI4/%u %u %u\n",
+                   rule->protocol == IPPROTO_TCP ? "tcp" : "udp",
+                   &rule->daddr, rule->prefix, ntohs(rule->dport), ntohs(rule->new_port));
+    }
+    mutex_unlock(&span_rules_lock);
+    return 0;
+}
+
+static int span_rules_open(struct inode *inode, struct file *file) {
+    return single_open(file, span_rules_show, NULL);
+}
+
+static const struct proc_ops span_rules_ops = {
+    .proc_open = span_rules_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+    .proc_write = span_rules_write,
+};
+
+// Постановка копии в отложенную очередь текущего CPU.
+// Очередь полна - копия выбрасывается. Возвращает false, если выброшена
+static bool span_enqueue(struct sk_buff_head *list, struct sk_buff *skb) {
+    if (skb_queue_len(list) >= READ_ONCE(queue_len)) {
+        kfree_skb(skb);
+        this_cpu_inc(span_stats.queue_drops);
+        return false;
+    }
+    __skb_queue_tail(list, skb);
+    tasklet_schedule(&this_cpu_ptr(&span_queue)->tasklet);
+    return true;
+}
+
+// Перенос не больше n пакетов из очереди в пачку
+static void span_take(struct sk_buff_head *list, struct sk_buff_head *batch, unsigned int n) {
+    struct sk_buff *skb;
+
+    __skb_queue_head_init(batch);
+    while (n-- && (skb = __skb_dequeue(list)) != NULL)
+        __skb_queue_tail(batch, skb);
+}
+
+// Отправка пачки копий SPAN. Каждая копия уже указывает на mirror_if
+// (skb->dev) и держит на него ссылку, взятую при постановке в очередь
+static void span_xmit_batch(struct sk_buff_head *batch) {
+    struct sk_buff *skb, *list, **tail;
+    struct net_device *dev;
+    struct netdev_queue *txq;
+    int cpu = smp_processor_id();
+    unsigned int refs;
+    bool again = false;
+    u16 queue;
+
+    while ((skb = skb_peek(batch)) != NULL) {
+        // Подряд идущие копии для одного устройства - в один список
+        dev = skb->dev;
+        list = NULL;
+        tail = &list;
+        refs = 0;
+        while ((skb = skb_peek(batch)) != NULL && skb->dev == dev) {
+            __skb_unlink(skb, batch);
+            *tail = skb;
+            tail = &skb->next;
+            refs++;
+        }
+
+        if (!netif_running(dev) || !netif_carrier_ok(dev)) {
+            this_cpu_add(span_stats.span_fail, refs);
+            kfree_skb_list(list);
+            goto put;
+        }
+
+        // Мы обходим qdisc, поэтому то, что обычно делает dev_queue_xmit,
+        // делаем сами: GSO, досчет контрольной суммы, линеаризация для
+        // устройств без SG, вставка тега VLAN - по возможностям устройства
+        list = validate_xmit_skb_list(list, dev, &again);
+
+        // Пачкой в одну очередь устройства. xmit_more = true у всех,
+        // кроме последнего: драйвер отложит запуск передачи до конца пачки
+        queue = cpu % dev->real_num_tx_queues;
+        txq = netdev_get_tx_queue(dev, queue);
+        HARD_TX_LOCK(dev, txq, cpu);
+        while ((skb = list) != NULL) {
+            netdev_tx_t rc;
+
+            list = skb->next;
+            skb_mark_not_on_list(skb);
+            if (netif_xmit_frozen_or_drv_stopped(txq)) {
+                kfree_skb(skb);
+                this_cpu_inc(span_stats.span_fail);
+                continue;
+            }
+            skb_set_queue_mapping(skb, queue);
+            rc = netdev_start_xmit(skb, dev, txq, list != NULL);
+            if (dev_xmit_complete(rc)) {
+                this_cpu_inc(span_stats.spanned);
+            } else {
+                kfree_skb(skb); // NETDEV_TX_BUSY: пакет остался нашим
+                this_cpu_inc(span_stats.span_fail);
+            }
+        }
+        HARD_TX_UNLOCK(dev, txq);
+put:
+        while (refs--)
+            dev_put(dev);
+    }
+}
+
+// Повторный ввод пачки копий в стек. Мы уже в softirq, поэтому пакет
+// обрабатывается сразу, без второй очереди backlog. Ссылку на устройство
+// приема копия держала, пока лежала в очереди
+static void span_reinject_batch(struct sk_buff_head *batch) {
+    struct net_device *dev;
+    struct sk_buff *skb;
+    unsigned int len;
+
+    while ((skb = __skb_dequeue(batch)) != NULL) {
+        dev = skb->dev;
+        len = skb->len;
+        if (netif_receive_skb(skb) == NET_RX_DROP) {
+            this_cpu_inc(span_stats.reinject_fail);
+            trace_span_fail(SPAN_FAIL_REINJECT, len);
+        } else {
+            this_cpu_inc(span_stats.mirrored);
+        }
+        dev_put(dev);
+    }
+}
+
+// Разбор отложенных очередей текущего CPU: не больше budget пакетов из
+// каждой за запуск, остаток - в следующем запуске тасклета
+static void span_queue_poll(struct tasklet_struct *t) {
+    struct span_queue *q = from_tasklet(q, t, tasklet);
+    unsigned int n = max(READ_ONCE(budget), 1U);
+    struct sk_buff_head batch;
+
+    span_take(&q->xmit, &batch, n);
+    if (!skb_queue_empty(&batch))
+        span_xmit_batch(&batch);
+
+    span_take(&q->reinject, &batch, n);
+    span_reinject_batch(&batch);
+
+    if (!skb_queue_empty(&q->xmit) || !skb_queue_empty(&q->reinject))
+        tasklet_schedule(t);
+}
+
+// Копия пакета с source_if в очередь SPAN. Копия нужна без изменений,
+// поэтому хватает клона: данные общие с оригиналом
+static void span_mirror(struct sk_buff *skb) {
+    struct net_device *dev;
+    struct sk_buff *skb_dup;
+    int mac_len;
+
+    // Обработчики packet_type вызываются под rcu_read_lock
+    dev = rcu_dereference(span_mirror_dev);
+    if (!dev || !skb_mac_header_was_set(skb))
+        return;
+    // Зеркалим кадры Ethernet: заголовок L2 еще лежит перед данными
+    mac_len = skb_network_header(skb) - skb_mac_header(skb);
+    if (mac_len != ETH_HLEN)
+        return;
+
+    skb_dup = skb_clone(skb, GFP_ATOMIC);
+    if (!skb_dup) {
+        this_cpu_inc(span_stats.copy_fail);
+        trace_span_fail(SPAN_FAIL_COPY, skb->len);
+        return;
+    }
+    skb_push(skb_dup, skb_dup->data - skb_mac_header(skb_dup));
+    skb_dup->mark = SPAN_MIRROR_MARK;
+    // Сумма, проверенная при приеме (CHECKSUM_COMPLETE), при передаче не значит ничего
+    skb_forward_csum(skb_dup);
+    // Копия сразу принадлежит mirror_if: пока она в очереди, устройство
+    // не исчезнет, а на source_if копия больше не ссылается
+    dev_hold(dev);
+    skb_dup->dev = dev;
+
+    if (!span_enqueue(&this_cpu_ptr(&span_queue)->xmit, skb_dup))
+        dev_put(dev);
+}
+
+// Отвод: каждый кадр source_if приходит сюда до разбора протоколов.
+// skb общий с остальными получателями, поэтому только клонируем его.
+// На отвод попадают и отправленные кадры - их не зеркалим, как и наши
+// же копии (вернувшиеся через пару veth или введенные повторно)
+static int span_tap_rcv(struct sk_buff *skb, struct net_device *dev,
+                        struct packet_type *pt, struct net_device *orig_dev) {
+    if (skb->pkt_type != PACKET_OUTGOING &&
+        skb->mark != SPAN_MIRROR_MARK && skb->mark != SPAN_REINJECT_MARK)
+        span_mirror(skb);
+    consume_skb(skb);
+    return NET_RX_SUCCESS;
+}
+
+// Слежение за source_if и mirror_if: они могут появиться и исчезнуть
+// в любой момент. Вызывается под RTNL
+static int span_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr) {
+    struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+    struct net_device *old;
+
+    if (!net_eq(dev_net(dev), &init_net))
+        return NOTIFY_DONE;
+
+    switch (event) {
+    case NETDEV_REGISTER:
+        if (source_if[0] && !strcmp(dev->name, source_if) && !span_tap_added) {
+            WRITE_ONCE(span_source_ifindex, dev->ifindex);
+            // Отвод только на этом устройстве: остальным интерфейсам он
+            // ничего не стоит
+            span_tap.type = htons(ETH_P_ALL);
+            span_tap.func = span_tap_rcv;
+            span_tap.dev = dev;
+            dev_add_pack(&span_tap);
+            span_tap_added = true;
+        }
+        if (mirror_if[0] && !strcmp(dev->name, mirror_if) &&
+            !rtnl_dereference(span_mirror_dev)) {
+            dev_hold(dev);
+            rcu_assign_pointer(span_mirror_dev, dev);
+            printk(KERN_INFO "Localhost duplicator: mirroring %s to %s\n",
+                   source_if[0] ? source_if : "(none)", dev->name);
+        }
+        break;
+    case NETDEV_UNREGISTER:
+        if (span_tap_added && span_tap.dev == dev) {
+            // Ждет отводы, которые уже получили кадр
+            dev_remove_pack(&span_tap);
+            span_tap_added = false;
+            WRITE_ONCE(span_source_ifindex, 0);
+        }
+        old = rtnl_dereference(span_mirror_dev);
+        if (old == dev) {
+            RCU_INIT_POINTER(span_mirror_dev, NULL);
+            // Ждем хуки, которые могли успеть прочитать указатель.
+            // Копии в очереди держат на устройство свои ссылки
+            synchronize_net();
+            dev_put(dev);
+        }
+        break;
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block span_netdev_nb = {
+    .notifier_call = span_netdev_event,
+};
+
+// Смена порта назначения в копии. Контрольную сумму TCP/UDP не
+// пересчитываем по всему пакету, а правим на разницу старого и нового
+// порта. Порт не входит в псевдозаголовок (pseudohdr = false): при
+// CHECKSUM_PARTIAL сумму досчитает устройство или стек, а skb->csum при
+// CHECKSUM_COMPLETE не меняется - разница в порту и в поле суммы гасят
+// друг друга. thoff - смещение заголовка L4 от skb->data
+static void span_set_port(struct sk_buff *skb, u8 protocol, unsigned int thoff,
+                          __be16 new_port) {
+    if (protocol == IPPROTO_TCP) {
+        struct tcphdr *tcp_header = (struct tcphdr *)(skb->data + thoff);
+
+        inet_proto_csum_replace2(&tcp_header->check, skb, tcp_header->dest, new_port, false);
+        tcp_header->dest = new_port;
+    } else {
+        struct udphdr *udp_header = (struct udphdr *)(skb->data + thoff);
+
+        // Нулевая сумма UDP означает "не считалась" - ее не трогаем
+        if (udp_header->check || skb->ip_summed == CHECKSUM_PARTIAL) {
+            inet_proto_csum_replace2(&udp_header->check, skb, udp_header->dest, new_port, false);
+            if (!udp_header->check)
+                udp_header->check = CSUM_MANGLED_0;
+        }
+        udp_header->dest = new_port;
+    }
+}
 
 static unsigned int hook_func(void *priv, struct sk_buff *skb,
                               const struct nf_hook_state *state) {
     struct sk_buff *skb_dup;
     struct iphdr *ip_header;
-    struct tcphdr *tcp_header;
-    struct udphdr *udp_header;
-    __be16 src_port = 0, dst_port = 0;
+    __be16 _ports[2], *ports;   // Порты источника и назначения: у TCP и UDP они в начале заголовка
+    __be16 src_port, dst_port, new_port;
+    unsigned int thoff, l4_len;
+    struct net_device *in_dev;
 
-    printk(KERN_INFO "DUPLICATE: 1: hook_func");
     if (!skb) return NF_ACCEPT;
+    // Наша же копия с новым портом: ни зеркалить, ни копировать ее снова
+    if (skb->mark == SPAN_REINJECT_MARK) return NF_ACCEPT;
+    this_cpu_inc(span_stats.seen);
+
+    // Копию SPAN снял отвод. Наша же копия, вернувшаяся на source_if
+    // (mirror_if и source_if - пара veth), стеку не нужна: иначе он
+    // получил бы каждый зеркалированный пакет дважды
+    if (state->in && state->in->ifindex == READ_ONCE(span_source_ifindex) &&
+        skb->mark == SPAN_MIRROR_MARK)
+        return NF_DROP;
 
     ip_header = ip_hdr(skb);
     if (!ip_header) return NF_ACCEPT;
 
-    printk(KERN_INFO "DUPLICATE: 2: !ip_header");
-    // Только TCP/UDP пакеты на 127.0.0.1
-    if (ip_header->daddr != htonl(INADDR_LOOPBACK) ||
-        (ip_header->protocol != IPPROTO_TCP && ip_header->protocol != IPPROTO_UDP)) {
-        return NF_ACCEPT;
-    }
-
-    printk(KERN_INFO "DUPLICATE: 3: ip_header->protocol == IPPROTO_TCP");
-    // Получаем порты из оригинального пакета
+    // Только TCP/UDP пакеты
     if (ip_header->protocol == IPPROTO_TCP) {
-        tcp_header = tcp_hdr(skb);
-        if (!tcp_header) {
-            return NF_ACCEPT;
-        }
-        src_port = tcp_header->source;
-        dst_port = tcp_header->dest;
+        l4_len = sizeof(struct tcphdr);
     } else if (ip_header->protocol == IPPROTO_UDP) {
-        udp_header = udp_hdr(skb);
-        if (!udp_header) {
-            return NF_ACCEPT;
-        }
-        src_port = udp_header->source;
-        dst_port = udp_header->dest;
+        l4_len = sizeof(struct udphdr);
+    } else {
+        return NF_ACCEPT;
+    }
+    // Фрагменты, кроме первого, начинаются не с заголовка L4
+    if (ip_is_fragment(ip_header) && (ntohs(ip_header->frag_off) & IP_OFFSET)) {
+        return NF_ACCEPT;
     }
 
-    printk(KERN_INFO "DUPLICATE: 4: dst_port = %d", ntohs(dst_port));
-
+    // Получаем порты из оригинального пакета. Заголовок может лежать
+    // и не в линейной части, поэтому читаем через skb_header_pointer
+    thoff = skb_network_offset(skb) + ip_hdrlen(skb);
+    ports = skb_header_pointer(skb, thoff, sizeof(_ports), _ports);
+    if (!ports) {
+        return NF_ACCEPT;
+    }
+    src_port = ports[0];
+    dst_port = ports[1];
 
-    // ФИЛЬТР: обрабатываем только пакеты с портом 8807
-    if (dst_port != htons(8807)) {
+    // ФИЛЬТР: обрабатываем только пакеты, для которых есть правило
+    new_port = span_rule_match(ip_header->protocol, ip_header->daddr, dst_port);
+    if (!new_port) {
         return NF_ACCEPT;
     }
+    this_cpu_inc(span_stats.matched);
+    trace_span_match(ip_header, src_port, dst_port, skb->len);
 
-    // Создаем копию
-    skb_dup = skb_copy(skb, GFP_ATOMIC);
-    if (!skb_dup) return NF_ACCEPT;
+    // Создаем копию: клон делит данные с оригиналом, а skb_ensure_writable
+    // делает собственными только заголовки до конца L4. Страницы с данными
+    // остаются общими, и большая датаграмма не копируется целиком
+    skb_dup = skb_clone(skb, GFP_ATOMIC);
+    if (!skb_dup || skb_ensure_writable(skb_dup, thoff + l4_len)) {
+        kfree_skb(skb_dup);
+        this_cpu_inc(span_stats.copy_fail);
+        trace_span_fail(SPAN_FAIL_COPY, skb->len);
+        return NF_ACCEPT;
+    }
 
-    printk(KERN_INFO "DUPLICATE: 5: skb_dup");
-    // Меняем порт в копии
+    // Меняем порт в копии (заголовки могли переехать - берем их заново)
     ip_header = ip_hdr(skb_dup);
-    if (ip_header->protocol == IPPROTO_TCP) {
-        tcp_header = tcp_hdr(skb_dup);
-        if (tcp_header) {
-            tcp_header->dest = target_port;
-        }
-    } else if (ip_header->protocol == IPPROTO_UDP) {
-        udp_header = udp_hdr(skb_dup);
-        if (udp_header) {
-            udp_header->dest = target_port;
-        }
-    }
+    span_set_port(skb_dup, ip_header->protocol, thoff, new_port);
+    skb_dup->mark = SPAN_REINJECT_MARK;
 
-    printk(KERN_INFO "DUPLICATE: 6: netif_rx");
-    // Просто повторно вводим пакет в сетевую подсистему
-    netif_rx(skb_dup);
+    // Повторно вводим копию в сетевую подсистему, но не отсюда: копия
+    // ждет в очереди, и всплеск не раздувает работу внутри PRE_ROUTING.
+    // Пока копия в очереди, устройство приема не должно исчезнуть
+    trace_span_mirror(ip_header, src_port, new_port, skb_dup->len);
+    in_dev = skb_dup->dev;
+    dev_hold(in_dev);
+    if (!span_enqueue(&this_cpu_ptr(&span_queue)->reinject, skb_dup))
+        dev_put(in_dev);
 
     return NF_ACCEPT;
 }
 
+// Остановка тасклетов и выброс того, что они не успели отправить.
+// Вызывается, когда хук и отвод уже сняты и новых копий не будет
+static void span_queues_purge(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct span_queue *q = per_cpu_ptr(&span_queue, cpu);
+        struct sk_buff *skb;
+
+        tasklet_kill(&q->tasklet);
+        // Копии в обеих очередях держат ссылку на свое устройство
+        while ((skb = __skb_dequeue(&q->xmit)) != NULL) {
+            dev_put(skb->dev);
+            kfree_skb(skb);
+        }
+        while ((skb = __skb_dequeue(&q->reinject)) != NULL) {
+            dev_put(skb->dev);
+            kfree_skb(skb);
+        }
+    }
+}
+
 static int __init duplicator_init(void) {
+    // Правила по умолчанию - прежний фильтр: TCP и UDP на 127.0.0.1:8807
+    // копируются на порт 8808
+    char tcp_rule[] = "add tcp 127.0.0.1 8807 8808";
+    char udp_rule[] = "add udp 127.0.0.1 8807 8808";
+    int err, cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct span_queue *q = per_cpu_ptr(&span_queue, cpu);
+
+        __skb_queue_head_init(&q->xmit);
+        __skb_queue_head_init(&q->reinject);
+        tasklet_setup(&q->tasklet, span_queue_poll);
+    }
+
+    err = span_rule_parse(tcp_rule);
+    if (!err)
+        err = span_rule_parse(udp_rule);
+    if (err)
+        goto fail_rules;
+
+    // Счетчики: cat /proc/net/span_driver
+    if (!proc_create_single("span_driver", 0444, init_net.proc_net, span_stats_show)) {
+        err = -ENOMEM;
+        goto fail_rules;
+    }
+    // Правила: cat и echo "add ..." > /proc/net/span_rules
+    if (!proc_create("span_rules", 0644, init_net.proc_net, &span_rules_ops)) {
+        err = -ENOMEM;
+        goto fail_stats;
+    }
+
     nfho.hook = hook_func;
     nfho.hooknum = NF_INET_PRE_ROUTING;
     nfho.pf = PF_INET;
     nfho.priority = NF_IP_PRI_FIRST;
 
-    nf_register_net_hook(&init_net, &nfho);
-    printk(KERN_INFO "Localhost duplicator: active on port 8808\n");
+    // Уведомления сразу приходят и для уже существующих интерфейсов;
+    // с этого момента отвод source_if может ставить копии в очередь
+    err = register_netdevice_notifier(&span_netdev_nb);
+    if (err)
+        goto fail_proc;
+
+    err = nf_register_net_hook(&init_net, &nfho);
+    if (err)
+        goto fail_notifier;
+    printk(KERN_INFO "Localhost duplicator: active, rules in /proc/net/span_rules\n");
     return 0;
+
+fail_notifier:
+    unregister_netdevice_notifier(&span_netdev_nb);
+fail_proc:
+    span_queues_purge();
+    remove_proc_entry("span_rules", init_net.proc_net);
+fail_stats:
+    remove_proc_entry("span_driver", init_net.proc_net);
+fail_rules:
+    span_rules_flush();
+    rcu_barrier();
+    return err;
 }
 
 static void __exit duplicator_exit(void) {
     nf_unregister_net_hook(&init_net, &nfho);
+    // Снимает отвод source_if и отпускает mirror_if (уведомление
+    // NETDEV_UNREGISTER для каждого интерфейса). После этого новых копий нет
+    unregister_netdevice_notifier(&span_netdev_nb);
+    span_queues_purge();
+    remove_proc_entry("span_rules", init_net.proc_net);
+    remove_proc_entry("span_driver", init_net.proc_net);
+    // Ждем, пока освободятся правила, удаленные через RCU
+    span_rules_flush();
+    rcu_barrier();
     printk(KERN_INFO "Localhost duplicator: stopped\n");
 }
 
@@ -0,0 +1,84 @@
+// Точки трассировки span_driver для разбора отдельных пакетов.
+// Включаются через tracefs, например:
+//   echo 1 > /sys/kernel/tracing/events/span_driver/enable
+//   cat /sys/kernel/tracing/trace_pipe
+// Выключенная точка стоит одну проверку static key - в отличие от printk
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM span_driver
+
+#if !defined(_SPAN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SPAN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Причины, по которым копия не ушла (поле reason события span_fail)
+#define SPAN_FAIL_COPY     0 // Не удалось скопировать пакет
+#define SPAN_FAIL_REINJECT 1 // Стек не принял копию
+
+// Пакет совпал с фильтром (match) или его копия отправлена (mirror)
+DECLARE_EVENT_CLASS(span_pkt,
+    TP_PROTO(const struct iphdr *iph, __be16 sport, __be16 dport, unsigned int len),
+    TP_ARGS(iph, sport, dport, len),
+
+    TP_STRUCT__entry(
+        __field(__be32, saddr)          // Адрес источника
+        __field(__be32, daddr)          // Адрес назначения
+        __field(u8, protocol)           // IPPROTO_TCP или IPPROTO_UDP
+        __field(u16, sport)             // Порт источника
+        __field(u16, dport)             // Порт назначения
+        __field(unsigned int, len)      // Длина пакета
+    ),
+
+    TP_fast_assign(
+        __entry->saddr = iph->saddr;
+        __entry->daddr = iph->daddr;
+        __entry->protocol = iph->protocol;
+        __entry->sport = ntohs(sport);
+        __entry->dport = ntohs(dport);
+        __entry->len = len;
+    ),
+
+    TP_printk("%s %pI4:%u -> %pI4:%u len=%u",
+              __entry->protocol == IPPROTO_TCP ? "tcp" : "udp",
+              &__entry->saddr, __entry->sport,
+              &__entry->daddr, __entry->dport, __entry->len)
+);
+
+DEFINE_EVENT(span_pkt, span_match,
+    TP_PROTO(const struct iphdr *iph, __be16 sport, __be16 dport, unsigned int len),
+    TP_ARGS(iph, sport, dport, len));
+
+DEFINE_EVENT(span_pkt, span_mirror,
+    TP_PROTO(const struct iphdr *iph, __be16 sport, __be16 dport, unsigned int len),
+    TP_ARGS(iph, sport, dport, len));
+
+// Копия пакета потеряна
+TRACE_EVENT(span_fail,
+    TP_PROTO(int reason, unsigned int len),
+    TP_ARGS(reason, len),
+
+    TP_STRUCT__entry(
+        __field(int, reason)            // SPAN_FAIL_*
+        __field(unsigned int, len)      // Длина пакета
+    ),
+
+    TP_fast_assign(
+        __entry->reason = reason;
+        __entry->len = len;
+    ),
+
+    TP_printk("%s len=%u",
+              __print_symbolic(__entry->reason,
+                               { SPAN_FAIL_COPY, "copy" },
+                               { SPAN_FAIL_REINJECT, "reinject" }),
+              __entry->len)
+);
+
+#endif // _SPAN_TRACE_H
+
+// Заголовок лежит рядом с драйвером, а не в include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE span_trace
+#include <trace/define_trace.h>